@@ -0,0 +1,56 @@
+#include "arena.h"
+#include <cstdint>
+#include <new>
+
+Arena::Arena(size_t chunk_size) : chunk_size(chunk_size) {
+  grow(0);
+}
+
+Arena::~Arena() {
+  rewind({ nullptr, nullptr, nullptr, nullptr, 0 });
+}
+
+void Arena::rewind(const Mark& m) {
+  for (; cleanups != m.cleanups; cleanups = cleanups->next) cleanups->fn(cleanups->obj);
+  while (chunks != m.chunk) {
+    Chunk* next = chunks->next;
+    reserved -= chunks->size;
+    ::operator delete(chunks);
+    chunks = next;
+  }
+  cur = m.cur;
+  end = m.end;
+  used = m.used;
+}
+
+void* Arena::alloc(size_t n, size_t align) {
+  uintptr_t p = ((uintptr_t)cur + align - 1) & ~(uintptr_t)(align - 1);
+  if (!cur || p + n > (uintptr_t)end) {
+    grow(n + align);
+    p = ((uintptr_t)cur + align - 1) & ~(uintptr_t)(align - 1);
+  }
+  cur = (char*)(p + n);
+  used += n;
+  return (void*)p;
+}
+
+void Arena::defer(void* obj, void (*fn)(void*)) {
+  Cleanup* c = static_cast<Cleanup*>(alloc(sizeof(Cleanup), alignof(Cleanup)));
+  c->next = cleanups;
+  c->fn = fn;
+  c->obj = obj;
+  cleanups = c;
+}
+
+// Oversized requests get a chunk of their own; the rest share chunks of the
+// size picked from the script length.
+void Arena::grow(size_t n) {
+  size_t size = sizeof(Chunk) + (n > chunk_size ? n : chunk_size);
+  Chunk* c = static_cast<Chunk*>(::operator new(size));
+  c->next = chunks;
+  c->size = size;
+  chunks = c;
+  cur = (char*)(c + 1);
+  end = (char*)c + size;
+  reserved += size;
+}
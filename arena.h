@@ -0,0 +1,105 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Bump allocator for memory tied to one script run, chiefly parse trees.
+// Memory is taken from the general heap in a few large chunks and handed
+// back all at once when the arena is destroyed, so repeated script launches
+// don't fragment the ESP32 heap. rewind() drops everything allocated since
+// a mark, which lets each top-level form reuse the same space.
+struct Arena {
+  struct Chunk {
+    Chunk* next;
+    size_t size;
+  };
+
+  struct Cleanup {
+    Cleanup* next;
+    void (*fn)(void*);
+    void* obj;
+  };
+
+  Chunk* chunks = nullptr;
+  Cleanup* cleanups = nullptr;
+  char* cur = nullptr;
+  char* end = nullptr;
+  size_t chunk_size;
+  size_t used = 0;
+  size_t reserved = 0;
+
+  struct Mark {
+    Chunk* chunk;
+    Cleanup* cleanups;
+    char* cur;
+    char* end;
+    size_t used;
+  };
+
+  Arena(size_t chunk_size);
+  ~Arena();
+
+  Mark mark() const {
+    return { chunks, cleanups, cur, end, used };
+  }
+  void rewind(const Mark& m);
+
+  void* alloc(size_t n, size_t align = alignof(std::max_align_t));
+
+  template <typename T, typename... Args>
+  T* make(Args&&... args) {
+    T* o = new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    if (!std::is_trivially_destructible<T>::value)
+      defer(o, [](void* p) {
+        static_cast<T*>(p)->~T();
+      });
+    return o;
+  }
+
+private:
+  void defer(void* obj, void (*fn)(void*));
+  void grow(size_t n);
+};
+
+// Lets standard containers draw from an arena. A default-constructed
+// allocator uses the general heap, and copies of a container never inherit
+// the arena, so values copied out of a parse tree are ordinary heap data.
+template <typename T>
+struct ArenaAllocator {
+  using value_type = T;
+
+  Arena* arena = nullptr;
+
+  ArenaAllocator() {}
+  ArenaAllocator(Arena* a) : arena(a) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U>& o) : arena(o.arena) {}
+
+  T* allocate(size_t n) {
+    if (arena) return static_cast<T*>(arena->alloc(n * sizeof(T), alignof(T)));
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t) {
+    if (!arena) ::operator delete(p);
+  }
+
+  ArenaAllocator select_on_container_copy_construction() const {
+    return ArenaAllocator();
+  }
+
+  template <typename U>
+  bool operator==(const ArenaAllocator<U>& o) const {
+    return arena == o.arena;
+  }
+
+  template <typename U>
+  bool operator!=(const ArenaAllocator<U>& o) const {
+    return arena != o.arena;
+  }
+};
+
+#endif
@@ -0,0 +1,575 @@
+// Benchmarks for the interpreter hot paths. Every bench/*.txt script is run
+// the way runScriptTask runs it, plus a parse-only pass over a large
+// generated source, a launch of that source from its compiled image, and
+// an http.get-file download and a run of small http.get requests against a
+// server on a local socket.
+// Each script defines `bench-ops`, the number of operations its timed work
+// performs, so results are per operation.
+//
+//   lesp_bench [--reps N] [--baseline FILE] [--device TTY] [--dir DIR] [name...]
+//
+// One JSON object per benchmark goes to stdout:
+//
+//   {"name":"fib","ops":21891,"ns_per_op":61.2,"allocs_per_op":0.01,"peak_heap":18432,"gc_peak":9120}
+//
+// ns_per_op is the fastest of N runs. allocs_per_op counts every operator
+// new during the run (interpreter setup included) and peak_heap is the most
+// C++ heap the run held at once; gc_peak is the Lesp heap's own high-water
+// mark. Save the output and pass it back with --baseline to get a per-bench
+// comparison on stderr.
+//
+// With --device the scripts run on an ESP32 instead: copy bench/ to the SD
+// card, and each script is started over serial as `bench/<name>` and timed
+// from the "script: N us" line the shell prints when it finishes.
+// Allocation counts are not available there and are reported as null.
+
+#include "interpreter.h"
+#include "gc.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+#include <thread>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+#ifndef LESP_BENCH_DIR
+#define LESP_BENCH_DIR "bench"
+#endif
+
+// Every allocation carries a header holding its size so frees can be
+// subtracted from the live total. Host tasks allocate too, hence atomics.
+static std::atomic<size_t> alloc_count{ 0 };
+static std::atomic<size_t> alloc_live{ 0 };
+static std::atomic<size_t> alloc_peak{ 0 };
+
+static const size_t kHeader = 16;
+
+static void* counted_alloc(size_t n) {
+  char* p = static_cast<char*>(malloc(n + kHeader));
+  if (!p) throw std::bad_alloc();
+  *reinterpret_cast<size_t*>(p) = n;
+  alloc_count++;
+  size_t live = alloc_live += n;
+  if (live > alloc_peak) alloc_peak = live;
+  return p + kHeader;
+}
+
+static void counted_free(void* ptr) {
+  if (!ptr) return;
+  char* p = static_cast<char*>(ptr) - kHeader;
+  alloc_live -= *reinterpret_cast<size_t*>(p);
+  free(p);
+}
+
+void* operator new(size_t n) {
+  return counted_alloc(n);
+}
+
+void* operator new[](size_t n) {
+  return counted_alloc(n);
+}
+
+void* operator new(size_t n, const std::nothrow_t&) noexcept {
+  try {
+    return counted_alloc(n);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void* operator new[](size_t n, const std::nothrow_t&) noexcept {
+  try {
+    return counted_alloc(n);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void operator delete(void* p) noexcept {
+  counted_free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  counted_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  counted_free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  counted_free(p);
+}
+
+struct Result {
+  std::string name;
+  long ops = 0;
+  double ns_per_op = 0;
+  double allocs_per_op = -1;
+  long peak_heap = -1;
+  long gc_peak = -1;
+};
+
+struct Sample {
+  double ns = 0;
+  size_t allocs = 0;
+  size_t peak = 0;
+  size_t gc_peak = 0;
+  long ops = 0;
+  bool failed = false;
+};
+
+static double now_ns() {
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool read_text(const std::string& path, std::string& out) {
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) return false;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    for (size_t i = 0; i < n; i++)
+      if (buf[i] != '\r') out += buf[i];
+  fclose(f);
+  return true;
+}
+
+static long scan_ops(const std::string& src) {
+  size_t p = src.find("(def bench-ops ");
+  return p == std::string::npos ? 0 : atol(src.c_str() + p + 15);
+}
+
+static Sample run_script(const std::string& src, long) {
+  Sample s;
+  size_t allocs = alloc_count;
+  size_t live = alloc_live;
+  alloc_peak = live;
+
+  double start = now_ns();
+  {
+    Lesp vm(src.size());
+    vm.run_program(src.c_str(), std::vector<String>());
+    term_sync();
+    s.failed = vm.failed;
+    s.gc_peak = vm.heap->stats.peak;
+
+    Value ops;
+    if (vm.global.get("bench-ops", ops)) s.ops = ops.i;
+  }
+  s.ns = now_ns() - start;
+  s.allocs = alloc_count - allocs;
+  s.peak = alloc_peak - live;
+  return s;
+}
+
+// A few thousand forms shaped like real scripts: definitions, nested
+// calls, string and float literals.
+static std::string parse_source(long forms) {
+  std::string src;
+  char buf[256];
+  for (long i = 0; i < forms; i++) {
+    snprintf(buf, sizeof(buf),
+             "(def f%ld (lambda (a b) (if (< a %ld) (concat \"item-%ld\" (string b)) (+ a (* b 1.5)))))\n", i, i, i);
+    src += buf;
+  }
+  return src;
+}
+
+static Sample run_parse(const std::string& src, long forms) {
+  Sample s;
+  s.ops = forms;
+  size_t allocs = alloc_count;
+  size_t live = alloc_live;
+  alloc_peak = live;
+
+  double start = now_ns();
+  {
+    Lesp vm(src.size());
+    Parser p(src.c_str(), vm.arena);
+    while (!p.eof()) {
+      Arena::Mark m = vm.arena->mark();
+      p.parse();
+      vm.arena->rewind(m);
+    }
+    s.gc_peak = vm.heap->stats.peak;
+  }
+  s.ns = now_ns() - start;
+  s.allocs = alloc_count - allocs;
+  s.peak = alloc_peak - live;
+  return s;
+}
+
+// The parse benchmark's source launched as a script file the way the shell
+// launches one. main() runs it once first, so every timed run loads the
+// compiled image instead of parsing.
+static Sample run_load(const std::string& path, long forms) {
+  Sample s;
+  s.ops = forms;
+  size_t allocs = alloc_count;
+  size_t live = alloc_live;
+  alloc_peak = live;
+
+  double start = now_ns();
+  {
+    File f = SD.open(path.c_str());
+    Lesp vm(f.size());
+    vm.run_file(f, path, std::vector<String>());
+    s.failed = vm.failed;
+    s.gc_peak = vm.heap->stats.peak;
+  }
+  s.ns = now_ns() - start;
+  s.allocs = alloc_count - allocs;
+  s.peak = alloc_peak - live;
+  return s;
+}
+
+// Stand-in for a web server: every request on `listener` gets the same
+// `size` bytes with a Content-Length, or the tail of them for a Range, and
+// the connection is kept open for the next one unless the client says
+// otherwise. It allocates nothing, so the allocation counts stay the
+// script's own. Connections it accepts are counted in blob_connections.
+static std::atomic<long> blob_connections{ 0 };
+
+static void serve_blob(int listener, long size) {
+  static char block[64 * 1024];
+  for (size_t i = 0; i < sizeof(block); i++) block[i] = (char)(i * 7);
+  for (;;) {
+    int c = accept(listener, nullptr, nullptr);
+    if (c < 0) return;
+    blob_connections++;
+    int one = 1;
+    setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    bool open = true;
+    while (open) {
+      char req[2048];
+      size_t got = 0;
+      ssize_t n = 0;
+      req[0] = 0;
+      while (!strstr(req, "\r\n\r\n") && got < sizeof(req) - 1 && (n = recv(c, req + got, sizeof(req) - 1 - got, 0)) > 0) {
+        got += n;
+        req[got] = 0;
+      }
+      if (n <= 0) break;
+      long from = 0;
+      const char* r = strstr(req, "Range: bytes=");
+      if (r) from = std::min(size, atol(r + 13));
+      open = !strstr(req, "Connection: close");
+      char head[160];
+      int len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Length: %ld\r\nConnection: %s\r\n\r\n",
+                         from ? "206 Partial Content" : "200 OK", size - from, open ? "keep-alive" : "close");
+      open = open && send(c, head, len, MSG_NOSIGNAL) == len;
+      for (long left = size - from; open && left > 0;) {
+        ssize_t w = send(c, block, std::min<long>(left, sizeof(block)), MSG_NOSIGNAL);
+        open = w > 0;
+        left -= w;
+      }
+    }
+    close(c);
+  }
+}
+
+// Starts serve_blob on a free loopback port and returns the port.
+static int start_blob_server(long size) {
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (s < 0 || bind(s, (sockaddr*)&addr, len) != 0 || listen(s, 4) != 0 || getsockname(s, (sockaddr*)&addr, &len) != 0)
+    return -1;
+  std::thread(serve_blob, s, size).detach();
+  return ntohs(addr.sin_port);
+}
+
+static Result best_of(const std::string& name, int reps, Sample (*run)(const std::string&, long),
+                      const std::string& src, long arg) {
+  Result r;
+  r.name = name;
+  double best = 0;
+  for (int i = 0; i < reps; i++) {
+    Sample s = run(src, arg);
+    if (s.failed) {
+      fprintf(stderr, "bench: %s failed\n", name.c_str());
+      exit(1);
+    }
+    if (i == 0 || s.ns < best) best = s.ns;
+    long ops = s.ops > 0 ? s.ops : 1;
+    r.ops = ops;
+    r.allocs_per_op = (double)s.allocs / ops;
+    r.peak_heap = s.peak;
+    r.gc_peak = s.gc_peak;
+  }
+  r.ns_per_op = best / r.ops;
+  return r;
+}
+
+// Device mode: the ESP32 shell over a raw 115200 baud serial line.
+static int open_serial(const char* tty) {
+  int fd = open(tty, O_RDWR | O_NOCTTY);
+  if (fd < 0) return -1;
+  termios t;
+  if (tcgetattr(fd, &t) != 0) {
+    close(fd);
+    return -1;
+  }
+  cfmakeraw(&t);
+  cfsetispeed(&t, B115200);
+  cfsetospeed(&t, B115200);
+  tcsetattr(fd, TCSANOW, &t);
+  tcflush(fd, TCIOFLUSH);
+  return fd;
+}
+
+static bool read_line(int fd, std::string& line, int timeout_ms) {
+  line.clear();
+  for (;;) {
+    pollfd p = { fd, POLLIN, 0 };
+    if (poll(&p, 1, timeout_ms) <= 0) return false;
+    char c;
+    if (read(fd, &c, 1) != 1) return false;
+    if (c == '\n') return true;
+    if (c != '\r') line += c;
+  }
+}
+
+static bool run_device(int fd, const std::string& name, const std::string& src, int reps, Result& r) {
+  r.name = name;
+  r.ops = scan_ops(src);
+  if (r.ops <= 0) r.ops = 1;
+
+  double best = 0;
+  for (int i = 0; i < reps; i++) {
+    std::string cmd = "bench/" + name + "\n";
+    if (write(fd, cmd.c_str(), cmd.size()) != (ssize_t)cmd.size()) return false;
+
+    std::string line;
+    unsigned long us, live, peak, cycles;
+    for (;;) {
+      if (!read_line(fd, line, 120000)) return false;
+      if (sscanf(line.c_str(), "script: %lu us, heap: %lu bytes live, %lu peak, %lu collections", &us, &live, &peak,
+                 &cycles) == 4)
+        break;
+    }
+    if (i == 0 || us * 1000.0 < best) best = us * 1000.0;
+    r.gc_peak = peak;
+  }
+  r.ns_per_op = best / r.ops;
+  return true;
+}
+
+static void print_result(const Result& r) {
+  printf("{\"name\":\"%s\",\"ops\":%ld,\"ns_per_op\":%.1f", r.name.c_str(), r.ops, r.ns_per_op);
+  if (r.allocs_per_op >= 0) printf(",\"allocs_per_op\":%.2f", r.allocs_per_op);
+  else printf(",\"allocs_per_op\":null");
+  if (r.peak_heap >= 0) printf(",\"peak_heap\":%ld", r.peak_heap);
+  else printf(",\"peak_heap\":null");
+  printf(",\"gc_peak\":%ld}\n", r.gc_peak);
+  fflush(stdout);
+}
+
+static double json_number(const std::string& line, const char* key) {
+  std::string k = std::string("\"") + key + "\":";
+  size_t p = line.find(k);
+  if (p == std::string::npos) return -1;
+  const char* s = line.c_str() + p + k.size();
+  return strncmp(s, "null", 4) == 0 ? -1 : atof(s);
+}
+
+static std::map<std::string, std::string> load_baseline(const char* path) {
+  std::map<std::string, std::string> out;
+  std::string text;
+  if (!read_text(path, text)) {
+    fprintf(stderr, "bench: cannot read baseline %s\n", path);
+    return out;
+  }
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t nl = text.find('\n', pos);
+    if (nl == std::string::npos) nl = text.size();
+    std::string line = text.substr(pos, nl - pos);
+    size_t n = line.find("\"name\":\"");
+    if (n != std::string::npos) {
+      size_t e = line.find('"', n + 8);
+      out[line.substr(n + 8, e - n - 8)] = line;
+    }
+    pos = nl + 1;
+  }
+  return out;
+}
+
+static void compare(const Result& r, const std::map<std::string, std::string>& baseline) {
+  auto it = baseline.find(r.name);
+  if (it == baseline.end()) return;
+  double ns = json_number(it->second, "ns_per_op");
+  double allocs = json_number(it->second, "allocs_per_op");
+  fprintf(stderr, "%-12s %10.1f ns/op", r.name.c_str(), r.ns_per_op);
+  if (ns > 0) fprintf(stderr, " (%+6.1f%%)", (r.ns_per_op - ns) * 100.0 / ns);
+  if (r.allocs_per_op >= 0 && allocs >= 0)
+    fprintf(stderr, "  %8.2f allocs/op (was %.2f)", r.allocs_per_op, allocs);
+  fprintf(stderr, "\n");
+}
+
+static std::vector<std::string> list_scripts(const std::string& dir) {
+  std::vector<std::string> names;
+  DIR* d = opendir(dir.c_str());
+  if (!d) return names;
+  while (dirent* e = readdir(d)) {
+    std::string n = e->d_name;
+    if (n.size() > 4 && n.compare(n.size() - 4, 4, ".txt") == 0) names.push_back(n.substr(0, n.size() - 4));
+  }
+  closedir(d);
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+static int usage() {
+  fprintf(stderr, "usage: lesp_bench [--reps N] [--baseline FILE] [--device TTY] [--dir DIR] [name...]\n");
+  return 2;
+}
+
+int main(int argc, char** argv) {
+  int reps = 3;
+  const char* baseline_path = nullptr;
+  const char* device = nullptr;
+  std::string dir = LESP_BENCH_DIR;
+
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-' && argv[i][1] == '-'; i++) {
+    if (!strcmp(argv[i], "--reps") && i + 1 < argc) reps = std::max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--baseline") && i + 1 < argc) baseline_path = argv[++i];
+    else if (!strcmp(argv[i], "--device") && i + 1 < argc) device = argv[++i];
+    else if (!strcmp(argv[i], "--dir") && i + 1 < argc) dir = argv[++i];
+    else return usage();
+  }
+
+  std::vector<std::string> names;
+  for (; i < argc; i++) names.push_back(argv[i]);
+  if (names.empty()) {
+    names = list_scripts(dir);
+    if (!device) {
+      names.push_back("parse");
+      names.push_back("load");
+      names.push_back("download");
+      names.push_back("requests");
+    }
+  }
+
+  std::map<std::string, std::string> baseline;
+  if (baseline_path) baseline = load_baseline(baseline_path);
+
+  int fd = -1;
+  char sd_root[] = "/tmp/lesp-bench-XXXXXX";
+  if (device) {
+    fd = open_serial(device);
+    if (fd < 0) {
+      fprintf(stderr, "bench: cannot open %s\n", device);
+      return 1;
+    }
+  } else {
+    if (!mkdtemp(sd_root)) {
+      fprintf(stderr, "bench: cannot create a scratch SD directory\n");
+      return 1;
+    }
+    SD.set_root(sd_root);
+    init_builtin_libs();
+    term_start();
+  }
+
+  for (const std::string& name : names) {
+    Result r;
+    if (name == "parse" && !device) {
+      const long forms = 4000;
+      r = best_of(name, reps, run_parse, parse_source(forms), forms);
+    } else if (name == "load" && !device) {
+      const long forms = 4000;
+      const char* path = "/load.txt";
+      File f = SD.open(path, FILE_WRITE);
+      std::string src = parse_source(forms);
+      f.write(reinterpret_cast<const uint8_t*>(src.data()), src.size());
+      f.close();
+      run_load(path, forms);
+      r = best_of(name, reps, run_load, path, forms);
+      SD.remove(path);
+      SD.remove("/load.lsc");
+    } else if (name == "download" && !device) {
+      // ops are bytes, so ns_per_op is the inverse of the sustained rate.
+      const long bytes = 8 * 1024 * 1024;
+      int port = start_blob_server(bytes);
+      if (port < 0) {
+        fprintf(stderr, "bench: cannot listen for the download server\n");
+        return 1;
+      }
+      char src[256];
+      snprintf(src, sizeof(src),
+               "(include http)\n(def bench-ops %ld)\n(http.get-file \"http://127.0.0.1:%d/blob\" \"/download.bin\")\n",
+               bytes, port);
+      r = best_of(name, reps, run_script, src, 0);
+      File f = SD.open("/download.bin");
+      bool whole = f && (long)f.size() == bytes;
+      f.close();
+      SD.remove("/download.bin");
+      if (!whole) {
+        fprintf(stderr, "bench: download came out short\n");
+        return 1;
+      }
+      fprintf(stderr, "download: %.1f MB/s\n", 1000.0 / r.ns_per_op);
+    } else if (name == "requests" && !device) {
+      // Small GETs one after another to one host, as a script polling a
+      // REST endpoint makes them.
+      const long requests = 500;
+      int port = start_blob_server(200);
+      if (port < 0) {
+        fprintf(stderr, "bench: cannot listen for the request server\n");
+        return 1;
+      }
+      char src[256];
+      snprintf(src, sizeof(src),
+               "(include http)\n(def bench-ops %ld)\n"
+               "(loop (i 0) (if (< i bench-ops) (begin (http.get \"http://127.0.0.1:%d/status\") (recur (+ i 1)))))\n",
+               requests, port);
+      blob_connections = 0;
+      r = best_of(name, reps, run_script, src, 0);
+      // Each run keeps one connection alive for all its requests.
+      if (blob_connections.load() != reps) {
+        fprintf(stderr, "bench: %ld connections for %d runs of requests; keep-alive is not reusing them\n",
+                blob_connections.load(), reps);
+        return 1;
+      }
+    } else {
+      std::string src;
+      if (!read_text(dir + "/" + name + ".txt", src)) {
+        fprintf(stderr, "bench: no script %s/%s.txt\n", dir.c_str(), name.c_str());
+        return 1;
+      }
+      if (device) {
+        if (!run_device(fd, name, src, reps, r)) {
+          fprintf(stderr, "bench: no result from the device for %s\n", name.c_str());
+          return 1;
+        }
+      } else {
+        r = best_of(name, reps, run_script, src, 0);
+      }
+    }
+    print_result(r);
+    compare(r, baseline);
+  }
+
+  if (fd >= 0) close(fd);
+  else rmdir(sd_root);
+  return 0;
+}
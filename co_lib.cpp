@@ -0,0 +1,122 @@
+#include "co_lib.h"
+#include "vm.h"
+#include "gc.h"
+#include <deque>
+
+static const char CHANNEL_HANDLE[] = "channel";
+
+// A queue of at most `capacity` values between tasks. A task sending to a
+// full channel or receiving from an empty one waits until another task has
+// received or sent, then tries again.
+struct Channel : HandleObj {
+  std::deque<Value> items;
+  size_t capacity;
+  std::vector<Coroutine*> waiters;
+
+  explicit Channel(size_t n) : HandleObj(CHANNEL_HANDLE), capacity(n) {}
+  void trace(Heap& h) override {
+    for (auto& v : items) h.mark(v);
+    for (Coroutine* c : waiters) h.mark(c);
+  }
+  size_t footprint() const override {
+    return sizeof(Channel) + capacity * sizeof(Value);
+  }
+};
+
+static HandleObj* handle_arg(const std::vector<Value>& args, const char* kind) {
+  if (args.empty() || args[0].type != V_HANDLE) return nullptr;
+  HandleObj* h = static_cast<HandleObj*>(args[0].obj);
+  return h->kind == kind ? h : nullptr;
+}
+
+// (spawn f args...) starts f as a task and returns it. Reference mode has
+// no tasks, so there f runs to completion before spawn returns.
+Value b_spawn(const std::vector<Value>& args, Env* env) {
+  if (args.empty()) return Value::Nil();
+  Lesp* l = Lesp::current;
+  const Value& fn = args[0];
+  std::vector<Value> rest(args.begin() + 1, args.end());
+  if (fn.type == V_LAMBDA && fn.lambda->proto) return Value::Handle(l->vm->spawn(fn, rest));
+
+  Value r = apply(fn, rest, env);
+  Coroutine* c = l->heap->make<Coroutine>();
+  c->state = CO_DONE;
+  c->result = r;
+  return Value::Handle(c);
+}
+
+Value b_yield(const std::vector<Value>&, Env*) {
+  Lesp::current->vm->sleep(0);
+  return Value::Nil();
+}
+
+Value b_sleep(const std::vector<Value>& args, Env*) {
+  int ms = args.empty() ? 0 : (int)args[0].num();
+  Lesp::current->sleep(ms > 0 ? ms : 0);
+  return Value::Nil();
+}
+
+// (join task) waits for the task to finish and returns its result.
+Value b_join(const std::vector<Value>& args, Env*) {
+  Coroutine* c = static_cast<Coroutine*>(handle_arg(args, TASK_HANDLE));
+  if (!c) return Value::Nil();
+  if (c->state == CO_DONE) return c->result;
+  Lesp::current->vm->wait(c->waiters);
+  return Value::Nil();
+}
+
+Value b_done(const std::vector<Value>& args, Env*) {
+  Coroutine* c = static_cast<Coroutine*>(handle_arg(args, TASK_HANDLE));
+  return Value::Int(c && c->state == CO_DONE);
+}
+
+Value b_chan(const std::vector<Value>& args, Env*) {
+  int n = args.empty() ? CHANNEL_CAPACITY : (int)args[0].num();
+  return Value::Handle(Lesp::current->heap->make<Channel>(n > 0 ? n : 1));
+}
+
+// (send ch v) queues v, first waiting while the channel is full. A caller
+// that cannot wait, such as a callback from a builtin, queues it anyway.
+Value b_send(const std::vector<Value>& args, Env*) {
+  Channel* ch = static_cast<Channel*>(handle_arg(args, CHANNEL_HANDLE));
+  if (!ch || args.size() < 2) return Value::Int(0);
+  Lesp* l = Lesp::current;
+  if (ch->items.size() >= ch->capacity && l->vm->wait(ch->waiters)) return Value::Nil();
+  ch->items.push_back(args[1]);
+  l->heap->barrier(ch);
+  l->vm->wake(ch->waiters);
+  return Value::Int(1);
+}
+
+// (recv ch) returns the oldest value sent, or nil if there is none and the
+// caller cannot wait.
+Value b_recv(const std::vector<Value>& args, Env*) {
+  Channel* ch = static_cast<Channel*>(handle_arg(args, CHANNEL_HANDLE));
+  if (!ch) return Value::Nil();
+  Lesp* l = Lesp::current;
+  if (ch->items.empty()) {
+    l->vm->wait(ch->waiters);
+    return Value::Nil();
+  }
+  Value v = ch->items.front();
+  ch->items.pop_front();
+  l->vm->wake(ch->waiters);
+  return v;
+}
+
+Value b_pending(const std::vector<Value>& args, Env*) {
+  Channel* ch = static_cast<Channel*>(handle_arg(args, CHANNEL_HANDLE));
+  return Value::Int(ch ? ch->items.size() : 0);
+}
+
+void load_co_lib(Env* env) {
+  env->define("spawn", Value::Func(b_spawn));
+  env->define("yield", Value::Func(b_yield));
+  env->define("sleep", Value::Func(b_sleep));
+  env->define("join", Value::Func(b_join));
+  env->define("done?", Value::Func(b_done));
+  env->define("chan", Value::Func(b_chan));
+  env->define("send", Value::Func(b_send));
+  env->define("recv", Value::Func(b_recv));
+  env->define("pending", Value::Func(b_pending));
+}
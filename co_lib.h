@@ -0,0 +1,11 @@
+#ifndef CO_LIB_H
+#define CO_LIB_H
+
+#include "interpreter.h"
+
+// Values a channel made with (chan) holds before senders have to wait.
+constexpr size_t CHANNEL_CAPACITY = 1;
+
+void load_co_lib(Env* env);
+
+#endif
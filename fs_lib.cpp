@@ -1,39 +1,116 @@
 #include "fs_lib.h"
+#include "source.h"
+#include "gc.h"
 #include <SD.h>
 #include <Arduino.h>
+#include <cstring>
+
+static const char FILE_HANDLE[] = "file";
+
+// An open file with one FS_BUFFER-sized buffer: read-ahead for files opened
+// with "r", pending output otherwise. Output is written out when the buffer
+// fills, on seek and on close, and closing happens at the latest when the
+// handle is collected or the script's heap goes away.
+struct FileObj : HandleObj {
+  File file;
+  bool writing;
+  std::vector<char> buf;
+  size_t pos = 0;
+  size_t len = 0;
+
+  FileObj(File f, bool w) : HandleObj(FILE_HANDLE), file(f), writing(w), buf(FS_BUFFER) {}
+  ~FileObj() {
+    close();
+  }
+  size_t footprint() const override {
+    return sizeof(FileObj) + buf.capacity();
+  }
+
+  bool fill() {
+    if (pos < len) return true;
+    pos = 0;
+    len = file ? file.read(reinterpret_cast<uint8_t*>(buf.data()), buf.size()) : 0;
+    return len > 0;
+  }
+
+  void flush() {
+    if (writing && len && file) file.write(reinterpret_cast<const uint8_t*>(buf.data()), len);
+    if (writing) len = 0;
+  }
+
+  void write(const char* s, size_t n) {
+    if (len + n > buf.size()) flush();
+    if (n >= buf.size()) {
+      file.write(reinterpret_cast<const uint8_t*>(s), n);
+      return;
+    }
+    memcpy(buf.data() + len, s, n);
+    len += n;
+  }
+
+  // Appends the next line, without its "\n" or "\r\n", to `out`; false
+  // once the file is exhausted.
+  bool read_line(std::string& out) {
+    if (!fill()) return false;
+    while (fill()) {
+      const char* start = buf.data() + pos;
+      const char* nl = static_cast<const char*>(memchr(start, '\n', len - pos));
+      size_t n = nl ? nl - start : len - pos;
+      out.append(start, n);
+      pos += n;
+      if (nl) {
+        pos++;
+        break;
+      }
+    }
+    if (!out.empty() && out.back() == '\r') out.pop_back();
+    return true;
+  }
+
+  size_t read_bytes(char* out, size_t n) override {
+    if (writing || !fill()) return 0;
+    n = std::min(n, len - pos);
+    memcpy(out, buf.data() + pos, n);
+    pos += n;
+    return n;
+  }
+
+  void close() {
+    if (!file) return;
+    flush();
+    file.close();
+  }
+};
+
+static FileObj* file_arg(const std::vector<Value>& args) {
+  if (args.empty() || args[0].type != V_HANDLE) return nullptr;
+  HandleObj* h = static_cast<HandleObj*>(args[0].obj);
+  return h->kind == FILE_HANDLE ? static_cast<FileObj*>(h) : nullptr;
+}
 
 Value b_fs_exists(const std::vector<Value>& args, Env*) {
   if (args.empty() || args[0].type != V_STRING) return Value::Int(0);
-  String path = "/" + String(args[0].str.c_str());
+  String path = "/" + String(args[0].str().c_str());
   return Value::Int(SD.exists(path.c_str()));
 }
 
 Value b_fs_read(const std::vector<Value>& args, Env*) {
   if (args.empty() || args[0].type != V_STRING) return Value::String("");
-  String path = "/" + String(args[0].str.c_str());
-  Serial.println(path);
-  File f = SD.open(path.c_str());
-  if (!f) Serial.println("okay");
-  if (!f) return Value::String("");
-
-  String content;
-  while (f.available()) {
-    char c = f.read();
-    if (c != '\r') content += c;
-  }
-  f.close();
-  return Value::String(content.c_str());
+  String path = "/" + String(args[0].str().c_str());
+  std::string content;
+  if (!read_file(path.c_str(), content)) return Value::String("");
+  return Value::String(std::move(content));
 }
 
 Value b_fs_write(const std::vector<Value>& args, Env*) {
   if (args.size() < 2 || args[0].type != V_STRING || args[1].type != V_STRING)
     return Value::Int(0);
 
-  String path = "/" + String(args[0].str.c_str());
+  String path = "/" + String(args[0].str().c_str());
   File f = SD.open(path.c_str(), FILE_WRITE);
   if (!f) return Value::Int(0);
 
-  f.print(args[1].str.c_str());
+  f.print(args[1].str().c_str());
   f.close();
   return Value::Int(1);
 }
@@ -42,25 +119,128 @@ Value b_fs_append(const std::vector<Value>& args, Env*) {
   if (args.size() < 2 || args[0].type != V_STRING || args[1].type != V_STRING)
     return Value::Int(0);
 
-  String path = "/" + String(args[0].str.c_str());
+  String path = "/" + String(args[0].str().c_str());
   File f = SD.open(path.c_str(), FILE_APPEND);
   if (!f) return Value::Int(0);
 
-  f.print(args[1].str.c_str());
+  f.print(args[1].str().c_str());
   f.close();
   return Value::Int(1);
 }
 
 Value b_fs_remove(const std::vector<Value>& args, Env*) {
   if (args.empty() || args[0].type != V_STRING) return Value::Int(0);
-  String path = "/" + String(args[0].str.c_str());
+  String path = "/" + String(args[0].str().c_str());
   return Value::Int(SD.remove(path.c_str()));
 }
 
+// (fs.open path [mode]) with mode "r" (default), "w" or "a".
+Value b_fs_open(const std::vector<Value>& args, Env*) {
+  Heap* heap = current_heap();
+  if (!heap || args.empty() || args[0].type != V_STRING) return Value::Nil();
+  const char* mode = FILE_READ;
+  bool writing = false;
+  if (args.size() > 1 && args[1].type == V_STRING) {
+    const std::string& m = args[1].str();
+    if (m == "w") mode = FILE_WRITE;
+    else if (m == "a") mode = FILE_APPEND;
+    else if (m != "r") return Value::Nil();
+    writing = m != "r";
+  }
+
+  String path = "/" + String(args[0].str().c_str());
+  File f = SD.open(path.c_str(), mode);
+  if (!f) return Value::Nil();
+  return Value::Handle(heap->make<FileObj>(f, writing));
+}
+
+Value b_fs_read_line(const std::vector<Value>& args, Env*) {
+  FileObj* f = file_arg(args);
+  if (!f || f->writing) return Value::Nil();
+  std::string line;
+  if (!f->read_line(line)) return Value::Nil();
+  return Value::String(std::move(line));
+}
+
+Value b_fs_read_chunk(const std::vector<Value>& args, Env*) {
+  FileObj* f = file_arg(args);
+  if (!f || f->writing || args.size() < 2) return Value::Nil();
+  size_t want = args[1].num() > 0 ? (size_t)args[1].num() : 0;
+  std::string out;
+  while (out.size() < want && f->fill()) {
+    size_t n = std::min(want - out.size(), f->len - f->pos);
+    out.append(f->buf.data() + f->pos, n);
+    f->pos += n;
+  }
+  if (out.empty() && want) return Value::Nil();
+  return Value::String(std::move(out));
+}
+
+Value b_fs_write_chunk(const std::vector<Value>& args, Env*) {
+  FileObj* f = file_arg(args);
+  if (!f || !f->writing || !f->file || args.size() < 2 || args[1].type != V_STRING) return Value::Int(0);
+  const std::string& s = args[1].str();
+  f->write(s.data(), s.size());
+  return Value::Int((int)s.size());
+}
+
+Value b_fs_seek(const std::vector<Value>& args, Env*) {
+  FileObj* f = file_arg(args);
+  if (!f || !f->file || args.size() < 2) return Value::Int(0);
+  f->flush();
+  f->pos = f->len = 0;
+  return Value::Int(f->file.seek((uint32_t)args[1].num()));
+}
+
+Value b_fs_close(const std::vector<Value>& args, Env*) {
+  FileObj* f = file_arg(args);
+  if (!f) return Value::Int(0);
+  f->close();
+  return Value::Int(1);
+}
+
+static int each_line(FileObj* f, const Value& fn, Env* env) {
+  std::vector<Value> line(1);
+  std::string text;
+  int count = 0;
+  while (!Lesp::current->halted) {
+    text.clear();
+    if (!f->read_line(text)) break;
+    line[0] = Value::String(text);
+    apply(fn, line, env);
+    count++;
+  }
+  return count;
+}
+
+// (fs.lines file fn) calls fn with each remaining line of an open handle,
+// or of the file at a path, and returns how many lines it read. A file
+// named by path is opened here and closed before returning.
+Value b_fs_lines(const std::vector<Value>& args, Env* env) {
+  if (args.size() < 2) return Value::Int(0);
+  if (args[0].type == V_STRING) {
+    String path = "/" + String(args[0].str().c_str());
+    File file = SD.open(path.c_str());
+    if (!file) return Value::Int(0);
+    FileObj f(file, false);
+    return Value::Int(each_line(&f, args[1], env));
+  }
+  FileObj* f = file_arg(args);
+  if (!f || f->writing) return Value::Int(0);
+  return Value::Int(each_line(f, args[1], env));
+}
+
 void load_fs_lib(Env* env) {
   env->define("exists", Value::Func(b_fs_exists));
   env->define("read", Value::Func(b_fs_read));
   env->define("write", Value::Func(b_fs_write));
   env->define("append", Value::Func(b_fs_append));
   env->define("remove", Value::Func(b_fs_remove));
+  env->define("open", Value::Func(b_fs_open));
+  env->define("read-line", Value::Func(b_fs_read_line));
+  env->define("read-chunk", Value::Func(b_fs_read_chunk));
+  env->define("write-chunk", Value::Func(b_fs_write_chunk));
+  env->define("seek", Value::Func(b_fs_seek));
+  env->define("close", Value::Func(b_fs_close));
+  env->define("lines", Value::Func(b_fs_lines));
 }
\ No newline at end of file
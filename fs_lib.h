@@ -3,6 +3,9 @@
 
 #include "interpreter.h"
 
+// Bytes buffered per open file handle, for reads and writes alike.
+constexpr size_t FS_BUFFER = 512;
+
 void load_fs_lib(Env* env);
 
 #endif
\ No newline at end of file
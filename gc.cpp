@@ -0,0 +1,167 @@
+#include "gc.h"
+#include "vm.h"
+
+#include <stdint.h>
+
+static const size_t kMinHeap = 16 * 1024;
+static const size_t kStepBytes = 1024;
+static const size_t kStepWork = 64;
+
+Heap::~Heap() {
+  while (objects) {
+    Obj* next = objects->next;
+    delete objects;
+    objects = next;
+  }
+}
+
+void Heap::adopt(Obj* o) {
+  o->size = o->footprint();
+  o->next = objects;
+  objects = o;
+  // The sweep cursor may still be at the list head, so anything born while
+  // sweeping must already count as live.
+  if (phase == GC_SWEEP) o->mark = epoch;
+  debt += o->size;
+  stats.bytes += o->size;
+  stats.objects++;
+  if (stats.bytes > stats.peak) stats.peak = stats.bytes;
+}
+
+// Re-measures an object that grew or shrank in place. Objects outside the
+// heap (parse-tree nodes in the arena) were never measured and are skipped.
+void Heap::resized(Obj* o) {
+  if (!o->size) return;
+  size_t n = o->footprint();
+  if (n > o->size) debt += n - o->size;
+  stats.bytes = stats.bytes - o->size + n;
+  if (stats.bytes > stats.peak) stats.peak = stats.bytes;
+  o->size = n;
+}
+
+void Heap::step() {
+  size_t work = kStepWork + debt / 16;
+  debt = 0;
+  advance(work);
+  threshold = phase == GC_IDLE ? std::max(kMinHeap, stats.bytes) : kStepBytes;
+}
+
+void Heap::collect() {
+  while (phase != GC_IDLE) advance(SIZE_MAX);
+  do advance(SIZE_MAX);
+  while (phase != GC_IDLE);
+  debt = 0;
+  threshold = std::max(kMinHeap, stats.bytes);
+}
+
+void Heap::advance(size_t work) {
+  switch (phase) {
+    case GC_IDLE:
+      epoch += 2;
+      gray.clear();
+      phase = GC_MARK;
+      owner->mark_roots();
+      break;
+
+    case GC_MARK:
+      if (!trace(work)) break;
+      owner->mark_roots();
+      trace(SIZE_MAX);
+      phase = GC_SWEEP;
+      sweep_link = &objects;
+      break;
+
+    case GC_SWEEP:
+      if (!sweep(work)) break;
+      phase = GC_IDLE;
+      stats.cycles++;
+      break;
+  }
+}
+
+// Roots are traced on the spot rather than queued: frames still on the call
+// stack are not heap objects and may be freed before the gray list drains.
+void Heap::root(Obj* o) {
+  if (!o) return;
+  o->mark = epoch;
+  o->trace(*this);
+}
+
+void Heap::mark(const Value& v) {
+  switch (v.type) {
+    case V_STRING:
+    case V_LIST:
+    case V_MAP:
+    case V_LAMBDA: mark(v.obj); break;
+    case V_LIB: mark(v.lib_env); break;
+    case V_HANDLE: mark(v.obj); break;
+    default: break;
+  }
+}
+
+void Heap::mark(Obj* o) {
+  if (!o || o->mark == epoch || o->mark == epoch + 1 || o->shared()) return;
+  o->mark = epoch + 1;
+  gray.push_back(o);
+}
+
+void Heap::mark(Proto* p) {
+  for (auto& v : p->consts) mark(v);
+  for (Proto* inner : p->protos) mark(inner);
+}
+
+bool Heap::trace(size_t work) {
+  while (!gray.empty()) {
+    if (!work--) return false;
+    Obj* o = gray.back();
+    gray.pop_back();
+    o->mark = epoch;
+    o->trace(*this);
+  }
+  return true;
+}
+
+bool Heap::sweep(size_t work) {
+  while (Obj* o = *sweep_link) {
+    if (!work--) return false;
+    if (o->mark == epoch) {
+      sweep_link = &o->next;
+    } else {
+      *sweep_link = o->next;
+      release(o);
+    }
+  }
+  return true;
+}
+
+void Heap::release(Obj* o) {
+  stats.bytes -= o->size;
+  stats.objects--;
+  delete o;
+}
+
+void ListObj::trace(Heap& h) {
+  for (auto& v : items) h.mark(v);
+}
+
+void MapObj::trace(Heap& h) {
+  for (auto& e : entries) {
+    h.mark(e.key);
+    h.mark(e.val);
+  }
+}
+
+void Lambda::trace(Heap& h) {
+  h.mark(body);
+  h.mark(env);
+  h.mark(frame);
+}
+
+void Env::trace(Heap& h) {
+  for (auto& v : vals) h.mark(v);
+  h.mark(parent);
+}
+
+Heap* current_heap() {
+  return Lesp::current ? Lesp::current->heap : nullptr;
+}
@@ -0,0 +1,81 @@
+#ifndef GC_H
+#define GC_H
+
+#include "interpreter.h"
+#include <utility>
+
+enum GcPhase : uint8_t {
+  GC_IDLE,
+  GC_MARK,
+  GC_SWEEP
+};
+
+struct HeapStats {
+  size_t bytes = 0;
+  size_t objects = 0;
+  size_t peak = 0;
+  size_t cycles = 0;
+};
+
+// Per-script heap. Every object is threaded on `objects` and reclaimed by an
+// incremental mark-sweep collector driven from VM safepoints: each step
+// traces or sweeps a bounded number of objects in proportion to what was
+// allocated since the last one, so a script never pauses for a whole-heap
+// walk. Marks are epoch numbers, so objects living outside the heap (the
+// global Env, frames still on the call stack) never need clearing: `epoch`
+// is black (traced) and `epoch + 1` gray (queued), so an object sits on the
+// gray list at most once however often it is mutated.
+//
+// Mutating an object that may already be traced must go through barrier().
+// Roots (the VM stack, active frames, the global Env) are rescanned in full
+// before sweeping and need no barrier.
+struct Heap {
+  Lesp* owner;
+  Obj* objects = nullptr;
+  uint32_t epoch = 1;
+  GcPhase phase = GC_IDLE;
+  size_t debt = 0;
+  size_t threshold = 16 * 1024;
+  std::vector<Obj*> gray;
+  Obj** sweep_link = nullptr;
+  HeapStats stats;
+
+  Heap(Lesp* l) : owner(l) {}
+  ~Heap();
+
+  template <typename T, typename... Args>
+  T* make(Args&&... args) {
+    T* o = new T(std::forward<Args>(args)...);
+    adopt(o);
+    return o;
+  }
+
+  void adopt(Obj* o);
+  void resized(Obj* o);
+  bool wants_step() const {
+    return debt >= threshold;
+  }
+  void step();
+  void collect();
+
+  void barrier(Obj* o) {
+    if (phase == GC_MARK && o->mark == epoch) {
+      o->mark = epoch + 1;
+      gray.push_back(o);
+    }
+  }
+  void root(Obj* o);
+  void mark(const Value& v);
+  void mark(Obj* o);
+  void mark(Proto* p);
+
+private:
+  void advance(size_t work);
+  bool trace(size_t work);
+  bool sweep(size_t work);
+  void release(Obj* o);
+};
+
+Heap* current_heap();
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef HOST_ADAFRUIT_GFX_H
+#define HOST_ADAFRUIT_GFX_H
+
+#include "Arduino.h"
+
+class Adafruit_GFX : public Print {
+public:
+  Adafruit_GFX(int16_t w, int16_t h) : w_(w), h_(h), rw_(w), rh_(h) {}
+  int16_t width() const { return w_; }
+  int16_t height() const { return h_; }
+  void setRotation(uint8_t r) {
+    if (r & 1) { w_ = rh_; h_ = rw_; } else { w_ = rw_; h_ = rh_; }
+  }
+  void setTextColor(uint16_t c) { fg_ = c; }
+  void setTextColor(uint16_t c, uint16_t bg) { fg_ = c; bg_ = bg; }
+  void setTextSize(uint8_t) {}
+  void setTextWrap(bool) {}
+  void setCursor(int16_t x, int16_t y) { cx_ = x; cy_ = y; }
+  int16_t getCursorX() const { return cx_; }
+  int16_t getCursorY() const { return cy_; }
+  virtual void fillScreen(uint16_t c) { fillRect(0, 0, w_, h_, c); }
+  virtual void fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t c);
+  virtual void drawChar(int16_t x, int16_t y, unsigned char ch, uint16_t fg, uint16_t bg, uint8_t size);
+  size_t write(uint8_t c) override;
+  using Print::write;
+
+protected:
+  int16_t w_, h_, rw_, rh_;
+  int16_t cx_ = 0, cy_ = 0;
+  uint16_t fg_ = 0xFFFF, bg_ = 0xFFFF;
+};
+
+// Offscreen RGB565 drawing surface. The host has no font, so characters
+// only paint their background.
+class GFXcanvas16 : public Adafruit_GFX {
+public:
+  GFXcanvas16(uint16_t w, uint16_t h) : Adafruit_GFX(w, h), buffer_(new uint16_t[w * h]()) {}
+  ~GFXcanvas16() { delete[] buffer_; }
+  uint16_t* getBuffer() const { return buffer_; }
+  void fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t c) override;
+  void drawChar(int16_t x, int16_t y, unsigned char ch, uint16_t fg, uint16_t bg, uint8_t size) override;
+
+private:
+  uint16_t* buffer_;
+};
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef HOST_ADAFRUIT_ST7735_H
+#define HOST_ADAFRUIT_ST7735_H
+
+#include "Adafruit_GFX.h"
+
+#define INITR_BLACKTAB 0x02
+#define ST77XX_BLACK 0x0000
+#define ST77XX_WHITE 0xFFFF
+#define ST77XX_RED 0xF800
+#define ST77XX_GREEN 0x07E0
+#define ST77XX_BLUE 0x001F
+#define ST77XX_YELLOW 0xFFE0
+
+class Adafruit_ST7735 : public Adafruit_GFX {
+public:
+  Adafruit_ST7735(int8_t, int8_t, int8_t) : Adafruit_GFX(128, 160) {}
+  void initR(uint8_t) {}
+  void startWrite() {}
+  void endWrite() {}
+  void setAddrWindow(uint16_t, uint16_t, uint16_t, uint16_t) {}
+  void writePixels(uint16_t*, uint32_t, bool = true, bool = false) {}
+  void sendCommand(uint8_t, const uint8_t* = nullptr, uint8_t = 0) {}
+};
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// Host stand-ins for the parts of the Arduino-ESP32 core Lesp uses: String,
+// Print/Serial, the millis() clock and the FreeRTOS task and mutex calls,
+// all backed by POSIX. Only built for the `lesp` CLI, never for the device.
+
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include <mutex>
+
+using std::min;
+using std::max;
+
+class String {
+public:
+  String() {}
+  String(const char* s) : s_(s ? s : "") {}
+  String(const std::string& s) : s_(s) {}
+  String(char c) : s_(1, c) {}
+  String(int v) : s_(std::to_string(v)) {}
+  String(unsigned v) : s_(std::to_string(v)) {}
+  String(long v) : s_(std::to_string(v)) {}
+  String(unsigned long v) : s_(std::to_string(v)) {}
+  String(double v, int digits = 2) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", digits, v);
+    s_ = buf;
+  }
+  const char* c_str() const { return s_.c_str(); }
+  unsigned length() const { return s_.size(); }
+  char operator[](unsigned i) const { return i < s_.size() ? s_[i] : 0; }
+  char& operator[](unsigned i) { return s_[i]; }
+  String& operator+=(const String& o) { s_ += o.s_; return *this; }
+  String& operator+=(const char* o) { s_ += o; return *this; }
+  String& operator+=(char c) { s_ += c; return *this; }
+  bool reserve(unsigned n) { s_.reserve(n); return true; }
+  bool startsWith(const String& p) const { return s_.compare(0, p.s_.size(), p.s_) == 0; }
+  bool endsWith(const String& p) const {
+    return s_.size() >= p.s_.size() && s_.compare(s_.size() - p.s_.size(), p.s_.size(), p.s_) == 0;
+  }
+  int indexOf(char c, unsigned from = 0) const {
+    size_t p = s_.find(c, from);
+    return p == std::string::npos ? -1 : (int)p;
+  }
+  int indexOf(const String& t, unsigned from = 0) const {
+    size_t p = s_.find(t.s_, from);
+    return p == std::string::npos ? -1 : (int)p;
+  }
+  String substring(unsigned from) const { return from < s_.size() ? String(s_.substr(from)) : String(); }
+  String substring(unsigned from, unsigned to) const {
+    if (from > s_.size()) return String();
+    if (to > s_.size()) to = s_.size();
+    return to > from ? String(s_.substr(from, to - from)) : String();
+  }
+  void remove(unsigned idx) { if (idx < s_.size()) s_.erase(idx); }
+  void remove(unsigned idx, unsigned n) { if (idx < s_.size()) s_.erase(idx, n); }
+  int toInt() const { return atoi(s_.c_str()); }
+  bool operator==(const String& o) const { return s_ == o.s_; }
+  bool operator!=(const String& o) const { return s_ != o.s_; }
+  const char* begin() const { return s_.data(); }
+  const char* end() const { return s_.data() + s_.size(); }
+  friend String operator+(const String& a, const String& b) { return String(a.s_ + b.s_); }
+  friend String operator+(const String& a, const char* b) { return String(a.s_ + b); }
+  friend String operator+(const char* a, const String& b) { return String(a + b.s_); }
+
+private:
+  std::string s_;
+};
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* buf, size_t n) {
+    size_t w = 0;
+    while (n--) w += write(*buf++);
+    return w;
+  }
+  size_t print(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+  size_t print(const String& s) { return print(s.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int v) { return print(String(v)); }
+  size_t print(unsigned v) { return print(String(v)); }
+  size_t print(long v) { return print(String(v)); }
+  size_t print(unsigned long v) { return print(String(v)); }
+  size_t print(double v, int digits = 2) { return print(String(v, digits)); }
+  size_t println() { return print("\r\n"); }
+  size_t printf(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    return print(buf);
+  }
+  template <typename T> size_t println(const T& v) { return print(v) + println(); }
+};
+
+class HardwareSerial : public Print {
+public:
+  void begin(unsigned long) {}
+  int available();
+  int read();
+  size_t write(uint8_t c) override;
+  using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+typedef void* SemaphoreHandle_t;
+typedef void* TaskHandle_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+#define portMAX_DELAY 0xffffffffu
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define pdMS_TO_TICKS(ms) (ms)
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial);
+void vSemaphoreDelete(SemaphoreHandle_t s);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s);
+BaseType_t xTaskCreatePinnedToCore(void (*fn)(void*), const char* name, uint32_t stack,
+                                   void* param, UBaseType_t prio, TaskHandle_t* out, BaseType_t core);
+void vTaskDelete(TaskHandle_t t);
+void vTaskDelay(TickType_t ticks);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef HOST_HTTPCLIENT_H
+#define HOST_HTTPCLIENT_H
+
+// Minimal HTTP/1.1 client over plain sockets, enough to run the http
+// library against a local server. As on the device, end() drains what is
+// left of the body and leaves the connection open when both sides asked
+// for keep-alive, still holding the client so a later begin() can send
+// over it. The destructor stops whatever client it still holds.
+
+#include "WiFiClient.h"
+#include <vector>
+#include <utility>
+
+#define HTTP_CODE_OK 200
+#define HTTP_CODE_PARTIAL_CONTENT 206
+#define HTTP_CODE_RANGE_NOT_SATISFIABLE 416
+#define HTTPC_ERROR_CONNECTION_REFUSED (-1)
+#define HTTPC_ERROR_SEND_HEADER_FAILED (-2)
+#define HTTPC_ERROR_CONNECTION_LOST (-5)
+#define HTTPC_ERROR_NO_HTTP_SERVER (-7)
+
+class HTTPClient {
+public:
+  ~HTTPClient() {
+    if (client_) client_->stop();
+  }
+  bool begin(WiFiClient& client, const String& url);
+  void setReuse(bool reuse) { reuse_ = reuse; }
+  void setTimeout(uint16_t ms) { timeout_ = ms; }
+  void addHeader(const String& name, const String& value);
+  void collectHeaders(const char* keys[], size_t count);
+  String header(const char* name);
+  int GET();
+  int POST(const String& body);
+  int sendRequest(const char* method, const String& body = String());
+  int getSize() const { return size_; }
+  String getString();
+  WiFiClient* getStreamPtr() { return client_; }
+  WiFiClient& getStream() { return *client_; }
+  bool connected() { return client_ && (client_->connected() || client_->available()); }
+  void end();
+
+private:
+  WiFiClient* client_ = nullptr;
+  std::string host_, path_;
+  uint16_t port_ = 80;
+  bool reuse_ = true;
+  bool can_reuse_ = false;
+  uint16_t timeout_ = 5000;
+  int size_ = -1;
+  bool chunked_ = false;
+  std::vector<std::pair<std::string, std::string>> headers_;
+  std::vector<std::pair<std::string, std::string>> collected_;
+};
+
+#endif
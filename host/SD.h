@@ -0,0 +1,63 @@
+#ifndef HOST_SD_H
+#define HOST_SD_H
+
+// The SD card is a directory on the host: LESP_SD_ROOT, or whatever the
+// CLI passes to set_root().
+
+#include "Arduino.h"
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+class SPIClass;
+
+class File : public Print {
+public:
+  File() {}
+  File(FILE* fp, const std::string& name, long end = -1) : fp_(fp), name_(name), end_(end) {}
+  explicit operator bool() const { return fp_ != nullptr; }
+  int available();
+  int read();
+  size_t read(uint8_t* buf, size_t n);
+  int peek();
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* buf, size_t n) override;
+  bool seek(uint32_t pos);
+  size_t position();
+  size_t size();
+  void flush();
+  void close();
+  const char* name() const { return name_.c_str(); }
+  time_t getLastWrite();
+
+private:
+  FILE* fp_ = nullptr;
+  std::string name_;
+  long end_ = -1;
+};
+
+class SDFS {
+public:
+  bool begin(uint8_t cs = 0);
+  bool begin(uint8_t cs, SPIClass&, uint32_t = 0, const char* = "/sd", uint8_t = 5, bool = false) {
+    return begin(cs);
+  }
+  File open(const char* path, const char* mode = FILE_READ);
+  File open(const String& path, const char* mode = FILE_READ) { return open(path.c_str(), mode); }
+  bool exists(const char* path);
+  bool exists(const String& path) { return exists(path.c_str()); }
+  bool remove(const char* path);
+  bool remove(const String& path) { return remove(path.c_str()); }
+  bool rename(const char* from, const char* to);
+  bool mkdir(const char* path);
+  std::string host_path(const char* path) const;
+  void set_root(const std::string& root) { root_ = root; }
+
+private:
+  std::string root_ = ".";
+};
+
+extern SDFS SD;
+
+#endif
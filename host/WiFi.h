@@ -0,0 +1,39 @@
+#ifndef HOST_WIFI_H
+#define HOST_WIFI_H
+
+#include "Arduino.h"
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_DISCONNECTED = 6
+} wl_status_t;
+
+class IPAddress {
+public:
+  IPAddress(uint8_t a = 0, uint8_t b = 0, uint8_t c = 0, uint8_t d = 0) : b_{ a, b, c, d } {}
+  uint8_t operator[](int i) const { return b_[i]; }
+
+private:
+  uint8_t b_[4];
+};
+
+class WiFiClass {
+public:
+  int begin(const char* ssid, const char*) { status_ = WL_CONNECTED; ssid_ = ssid; return status_; }
+  bool disconnect() { status_ = WL_DISCONNECTED; return true; }
+  wl_status_t status() const { return status_; }
+  IPAddress localIP() const { return IPAddress(127, 0, 0, 1); }
+  int scanNetworks() { return 1; }
+  String SSID(int) const { return String("host"); }
+
+private:
+  wl_status_t status_ = WL_DISCONNECTED;
+  std::string ssid_;
+};
+
+extern WiFiClass WiFi;
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef HOST_WIFICLIENT_H
+#define HOST_WIFICLIENT_H
+
+#include "Arduino.h"
+
+class WiFiClient : public Print {
+public:
+  WiFiClient() {}
+  virtual ~WiFiClient() { stop(); }
+  WiFiClient(const WiFiClient&) = delete;
+  WiFiClient& operator=(const WiFiClient&) = delete;
+  virtual int connect(const char* host, uint16_t port);
+  virtual bool connected();
+  virtual int available();
+  virtual int read();
+  virtual int read(uint8_t* buf, size_t n);
+  size_t readBytes(uint8_t* buf, size_t n);
+  size_t readBytes(char* buf, size_t n) { return readBytes((uint8_t*)buf, n); }
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* buf, size_t n) override;
+  virtual void stop();
+  void setTimeout(uint32_t ms) { timeout_ = ms; }
+  explicit operator bool() { return connected(); }
+
+protected:
+  int fd_ = -1;
+  uint32_t timeout_ = 5000;
+  uint8_t rbuf_[1024];
+  size_t rpos_ = 0, rlen_ = 0;
+  bool fill(bool wait);
+};
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef HOST_WIFICLIENTSECURE_H
+#define HOST_WIFICLIENTSECURE_H
+
+#include "WiFiClient.h"
+
+// The host build has no TLS stack: a secure client behaves like a plain
+// TCP client so https:// URLs can be pointed at local stand-in servers.
+class WiFiClientSecure : public WiFiClient {
+public:
+  void setInsecure() {}
+  void setCACert(const char*) {}
+};
+
+#endif
@@ -0,0 +1,489 @@
+#include "Arduino.h"
+#include "SD.h"
+#include "Adafruit_GFX.h"
+#include "WiFi.h"
+#include "HTTPClient.h"
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+
+HardwareSerial Serial;
+SDFS SD;
+WiFiClass WiFi;
+
+static const auto host_epoch = std::chrono::steady_clock::now();
+
+unsigned long millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - host_epoch).count();
+}
+
+unsigned long micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - host_epoch).count();
+}
+
+void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield() {
+  std::this_thread::yield();
+}
+
+int HardwareSerial::available() {
+  pollfd p = { 0, POLLIN, 0 };
+  return poll(&p, 1, 0) > 0 ? 1 : 0;
+}
+
+int HardwareSerial::read() {
+  unsigned char c;
+  return ::read(0, &c, 1) == 1 ? c : -1;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  return fputc(c, stderr) == EOF ? 0 : 1;
+}
+
+// A mutex is a counting semaphore that starts with its one count given.
+struct HostSemaphore {
+  std::mutex m;
+  std::condition_variable cv;
+  unsigned count;
+  unsigned max;
+  HostSemaphore(unsigned max, unsigned count) : count(count), max(max) {}
+};
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  return new HostSemaphore(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial) {
+  return new HostSemaphore(max, initial);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t s) {
+  delete static_cast<HostSemaphore*>(s);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t wait) {
+  HostSemaphore* sem = static_cast<HostSemaphore*>(s);
+  std::unique_lock<std::mutex> lock(sem->m);
+  auto ready = [sem] { return sem->count > 0; };
+  if (wait == portMAX_DELAY) sem->cv.wait(lock, ready);
+  else if (!sem->cv.wait_for(lock, std::chrono::milliseconds(wait), ready)) return pdFALSE;
+  sem->count--;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s) {
+  HostSemaphore* sem = static_cast<HostSemaphore*>(s);
+  std::lock_guard<std::mutex> lock(sem->m);
+  if (sem->count == sem->max) return pdFALSE;
+  sem->count++;
+  sem->cv.notify_one();
+  return pdTRUE;
+}
+
+struct HostTask {
+  void (*fn)(void*);
+  void* param;
+};
+
+static void* host_task_entry(void* p) {
+  HostTask t = *static_cast<HostTask*>(p);
+  delete static_cast<HostTask*>(p);
+  t.fn(t.param);
+  return nullptr;
+}
+
+BaseType_t xTaskCreatePinnedToCore(void (*fn)(void*), const char*, uint32_t stack,
+                                   void* param, UBaseType_t, TaskHandle_t* out, BaseType_t) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, stack < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : stack);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t th;
+  int rc = pthread_create(&th, &attr, host_task_entry, new HostTask{ fn, param });
+  pthread_attr_destroy(&attr);
+  if (out) *out = rc == 0 ? (TaskHandle_t)th : nullptr;
+  return rc == 0 ? pdPASS : pdFALSE;
+}
+
+void vTaskDelete(TaskHandle_t t) {
+  if (!t) pthread_exit(nullptr);
+  pthread_cancel((pthread_t)t);
+}
+
+void vTaskDelay(TickType_t ticks) {
+  delay(ticks);
+}
+
+// Files opened for reading remember their size, so polling available()
+// once per byte costs no more than it does on the SD library.
+int File::available() {
+  if (!fp_) return 0;
+  long pos = ftell(fp_);
+  long end = end_;
+  if (end < 0) {
+    fseek(fp_, 0, SEEK_END);
+    end = ftell(fp_);
+    fseek(fp_, pos, SEEK_SET);
+  }
+  return end > pos ? (int)(end - pos) : 0;
+}
+
+int File::read() {
+  if (!fp_) return -1;
+  int c = fgetc(fp_);
+  return c == EOF ? -1 : c;
+}
+
+size_t File::read(uint8_t* buf, size_t n) {
+  return fp_ ? fread(buf, 1, n, fp_) : 0;
+}
+
+int File::peek() {
+  if (!fp_) return -1;
+  int c = fgetc(fp_);
+  if (c != EOF) ungetc(c, fp_);
+  return c == EOF ? -1 : c;
+}
+
+size_t File::write(uint8_t c) {
+  return fp_ && fputc(c, fp_) != EOF ? 1 : 0;
+}
+
+size_t File::write(const uint8_t* buf, size_t n) {
+  return fp_ ? fwrite(buf, 1, n, fp_) : 0;
+}
+
+bool File::seek(uint32_t pos) {
+  return fp_ && fseek(fp_, pos, SEEK_SET) == 0;
+}
+
+size_t File::position() {
+  return fp_ ? ftell(fp_) : 0;
+}
+
+size_t File::size() {
+  if (!fp_) return 0;
+  struct stat st;
+  fflush(fp_);
+  return fstat(fileno(fp_), &st) == 0 ? st.st_size : 0;
+}
+
+void File::flush() {
+  if (fp_) fflush(fp_);
+}
+
+void File::close() {
+  if (fp_) fclose(fp_);
+  fp_ = nullptr;
+}
+
+time_t File::getLastWrite() {
+  struct stat st;
+  return fp_ && fstat(fileno(fp_), &st) == 0 ? st.st_mtime : 0;
+}
+
+bool SDFS::begin(uint8_t) {
+  const char* root = getenv("LESP_SD_ROOT");
+  if (root) root_ = root;
+  return true;
+}
+
+std::string SDFS::host_path(const char* path) const {
+  std::string p = root_;
+  if (*path != '/') p += '/';
+  return p + path;
+}
+
+File SDFS::open(const char* path, const char* mode) {
+  std::string hp = host_path(path);
+  struct stat st;
+  if (stat(hp.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) return File();
+  FILE* fp = fopen(hp.c_str(), *mode == 'r' ? "rb" : *mode == 'a' ? "ab" : "wb");
+  if (!fp) return File();
+  return File(fp, path, *mode == 'r' && fstat(fileno(fp), &st) == 0 ? (long)st.st_size : -1);
+}
+
+bool SDFS::exists(const char* path) {
+  struct stat st;
+  return stat(host_path(path).c_str(), &st) == 0;
+}
+
+bool SDFS::remove(const char* path) {
+  return ::remove(host_path(path).c_str()) == 0;
+}
+
+bool SDFS::rename(const char* from, const char* to) {
+  return ::rename(host_path(from).c_str(), host_path(to).c_str()) == 0;
+}
+
+bool SDFS::mkdir(const char* path) {
+  return ::mkdir(host_path(path).c_str(), 0755) == 0;
+}
+
+void Adafruit_GFX::fillRect(int16_t, int16_t, int16_t, int16_t, uint16_t) {}
+
+void Adafruit_GFX::drawChar(int16_t, int16_t, unsigned char, uint16_t, uint16_t, uint8_t) {}
+
+void GFXcanvas16::fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t c) {
+  for (int16_t j = std::max<int16_t>(y, 0); j < y + h && j < h_; j++)
+    for (int16_t i = std::max<int16_t>(x, 0); i < x + w && i < w_; i++) buffer_[j * w_ + i] = c;
+}
+
+void GFXcanvas16::drawChar(int16_t x, int16_t y, unsigned char, uint16_t, uint16_t bg, uint8_t size) {
+  fillRect(x, y, 6 * size, 8 * size, bg);
+}
+
+size_t Adafruit_GFX::write(uint8_t c) {
+  drawChar(cx_, cy_, c, fg_, bg_, 1);
+  cx_ += 6;
+  return 1;
+}
+
+int WiFiClient::connect(const char* host, uint16_t port) {
+  stop();
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* res = nullptr;
+  if (getaddrinfo(host, std::to_string(port).c_str(), &hints, &res) != 0) return 0;
+  for (addrinfo* ai = res; ai; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) continue;
+    if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      fd_ = fd;
+      break;
+    }
+    ::close(fd);
+  }
+  freeaddrinfo(res);
+  return fd_ >= 0 ? 1 : 0;
+}
+
+bool WiFiClient::fill(bool wait) {
+  if (rpos_ < rlen_) return true;
+  if (fd_ < 0) return false;
+  pollfd p = { fd_, POLLIN, 0 };
+  if (poll(&p, 1, wait ? (int)timeout_ : 0) <= 0) return false;
+  ssize_t n = ::recv(fd_, rbuf_, sizeof(rbuf_), 0);
+  if (n <= 0) {
+    stop();
+    return false;
+  }
+  rpos_ = 0;
+  rlen_ = n;
+  return true;
+}
+
+bool WiFiClient::connected() {
+  if (rpos_ < rlen_) return true;
+  if (fd_ < 0) return false;
+  pollfd p = { fd_, POLLIN, 0 };
+  if (poll(&p, 1, 0) > 0) return fill(false) || rpos_ < rlen_;
+  return true;
+}
+
+int WiFiClient::available() {
+  if (rpos_ >= rlen_) fill(false);
+  return rlen_ - rpos_;
+}
+
+int WiFiClient::read() {
+  if (!fill(false)) return -1;
+  return rbuf_[rpos_++];
+}
+
+int WiFiClient::read(uint8_t* buf, size_t n) {
+  if (!fill(false)) return -1;
+  size_t k = std::min(n, rlen_ - rpos_);
+  memcpy(buf, rbuf_ + rpos_, k);
+  rpos_ += k;
+  return k;
+}
+
+size_t WiFiClient::readBytes(uint8_t* buf, size_t n) {
+  size_t got = 0;
+  while (got < n && fill(true)) {
+    size_t k = std::min(n - got, rlen_ - rpos_);
+    memcpy(buf + got, rbuf_ + rpos_, k);
+    rpos_ += k;
+    got += k;
+  }
+  return got;
+}
+
+size_t WiFiClient::write(const uint8_t* buf, size_t n) {
+  size_t sent = 0;
+  while (fd_ >= 0 && sent < n) {
+    ssize_t k = ::send(fd_, buf + sent, n - sent, MSG_NOSIGNAL);
+    if (k <= 0) {
+      stop();
+      break;
+    }
+    sent += k;
+  }
+  return sent;
+}
+
+void WiFiClient::stop() {
+  if (fd_ >= 0) ::close(fd_);
+  fd_ = -1;
+  rpos_ = rlen_ = 0;
+}
+
+bool HTTPClient::begin(WiFiClient& client, const String& url) {
+  std::string u = url.c_str();
+  size_t scheme = u.find("://");
+  if (scheme == std::string::npos) return false;
+  bool https = u.compare(0, scheme, "https") == 0;
+  size_t host_start = scheme + 3;
+  size_t path_start = u.find('/', host_start);
+  std::string hostport = u.substr(host_start, path_start == std::string::npos ? std::string::npos : path_start - host_start);
+  path_ = path_start == std::string::npos ? "/" : u.substr(path_start);
+  size_t colon = hostport.find(':');
+  port_ = https ? 443 : 80;
+  if (colon != std::string::npos) {
+    port_ = atoi(hostport.c_str() + colon + 1);
+    hostport.resize(colon);
+  }
+  host_ = hostport;
+  client_ = &client;
+  size_ = -1;
+  return !host_.empty();
+}
+
+void HTTPClient::addHeader(const String& name, const String& value) {
+  headers_.push_back({ name.c_str(), value.c_str() });
+}
+
+void HTTPClient::collectHeaders(const char* keys[], size_t count) {
+  collected_.clear();
+  for (size_t i = 0; i < count; i++) {
+    std::string key = keys[i];
+    for (auto& ch : key) ch = tolower(ch);
+    collected_.push_back({ key, "" });
+  }
+}
+
+String HTTPClient::header(const char* name) {
+  std::string key = name;
+  for (auto& ch : key) ch = tolower(ch);
+  for (auto& h : collected_)
+    if (h.first == key) return String(h.second);
+  return String();
+}
+
+int HTTPClient::GET() {
+  return sendRequest("GET");
+}
+
+int HTTPClient::POST(const String& body) {
+  return sendRequest("POST", body);
+}
+
+int HTTPClient::sendRequest(const char* method, const String& body) {
+  can_reuse_ = false;
+  if (!client_) return HTTPC_ERROR_CONNECTION_REFUSED;
+  client_->setTimeout(timeout_);
+  if (!client_->connected() && !client_->connect(host_.c_str(), port_))
+    return HTTPC_ERROR_CONNECTION_REFUSED;
+
+  std::string req = std::string(method) + " " + path_ + " HTTP/1.1\r\nHost: " + host_ + "\r\n";
+  req += reuse_ ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+  for (auto& h : headers_) req += h.first + ": " + h.second + "\r\n";
+  if (body.length()) req += "Content-Length: " + std::to_string(body.length()) + "\r\n";
+  req += "\r\n";
+  req += body.c_str();
+  headers_.clear();
+  if (client_->write((const uint8_t*)req.data(), req.size()) != req.size())
+    return HTTPC_ERROR_SEND_HEADER_FAILED;
+
+  int code = 0;
+  size_ = -1;
+  chunked_ = false;
+  for (auto& h : collected_) h.second.clear();
+  std::string line;
+  bool first = true;
+  while (true) {
+    uint8_t c;
+    if (client_->readBytes(&c, 1) != 1) return HTTPC_ERROR_CONNECTION_LOST;
+    if (c == '\r') continue;
+    if (c != '\n') {
+      line += (char)c;
+      continue;
+    }
+    if (line.empty()) break;
+    if (first) {
+      size_t sp = line.find(' ');
+      if (sp == std::string::npos) return HTTPC_ERROR_NO_HTTP_SERVER;
+      code = atoi(line.c_str() + sp + 1);
+      can_reuse_ = reuse_ && line.compare(0, 8, "HTTP/1.0") != 0;
+      first = false;
+    } else {
+      size_t colon = line.find(':');
+      std::string name = line.substr(0, colon);
+      for (auto& ch : name) ch = tolower(ch);
+      std::string value = colon == std::string::npos ? "" : line.substr(colon + 1);
+      while (!value.empty() && value[0] == ' ') value.erase(0, 1);
+      if (name == "content-length") size_ = atoi(value.c_str());
+      if (name == "transfer-encoding" && value.find("chunked") != std::string::npos) chunked_ = true;
+      if (name == "connection" && value.find("close") != std::string::npos) can_reuse_ = false;
+      for (auto& h : collected_)
+        if (h.first == name) h.second = value;
+    }
+    line.clear();
+  }
+  return code;
+}
+
+String HTTPClient::getString() {
+  std::string out;
+  if (!client_) return String();
+  if (size_ >= 0) {
+    out.resize(size_);
+    out.resize(client_->readBytes((uint8_t*)&out[0], size_));
+  } else if (chunked_) {
+    while (true) {
+      std::string len;
+      uint8_t c;
+      while (client_->readBytes(&c, 1) == 1 && c != '\n')
+        if (c != '\r') len += (char)c;
+      size_t n = strtoul(len.c_str(), nullptr, 16);
+      if (n == 0) {
+        client_->readBytes(&c, 1);
+        client_->readBytes(&c, 1);
+        break;
+      }
+      size_t at = out.size();
+      out.resize(at + n);
+      client_->readBytes((uint8_t*)&out[at], n);
+      client_->readBytes(&c, 1);
+      client_->readBytes(&c, 1);
+    }
+  } else {
+    uint8_t buf[512];
+    size_t n;
+    while ((n = client_->readBytes(buf, sizeof(buf))) > 0) out.append((char*)buf, n);
+  }
+  return String(out);
+}
+
+void HTTPClient::end() {
+  if (!connected()) return;
+  while (client_->available() > 0) client_->read();
+  if (reuse_ && can_reuse_) return;
+  client_->stop();
+  client_ = nullptr;
+}
@@ -0,0 +1,7 @@
+// Stand-ins for the sketch's display globals. The terminal renders into
+// the shim panel; the CLI sets term_sink to see its output.
+
+#include "interpreter.h"
+
+Adafruit_ST7735 tft(5, 22, 21);
+SemaphoreHandle_t termMutex = xSemaphoreCreateMutex();
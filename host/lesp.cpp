@@ -0,0 +1,87 @@
+// Host command-line runner: executes a Lesp script the way runScriptTask
+// does on the device, with the terminal mapped to stdout and the SD card
+// to a local directory.
+//
+//   lesp [--sd DIR] [--ref] [--stats] script.txt [args...]
+//
+// --sd sets the SD root (default: the script's directory), --ref runs the
+// tree-walking reference evaluator, --stats prints heap counters to stderr.
+// A script in the SD root is run through its compiled image (name.lsc)
+// like on the device; one elsewhere is always parsed.
+
+#include "interpreter.h"
+#include "gc.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static void print_to_stdout(const char* s, size_t n) {
+  fwrite(s, 1, n, stdout);
+}
+
+static int usage() {
+  fprintf(stderr, "usage: lesp [--sd DIR] [--ref] [--stats] script.txt [args...]\n");
+  return 2;
+}
+
+int main(int argc, char** argv) {
+  const char* sd_root = nullptr;
+  bool reference = false;
+  bool stats = false;
+
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-' && argv[i][1] == '-'; i++) {
+    if (!strcmp(argv[i], "--sd") && i + 1 < argc) sd_root = argv[++i];
+    else if (!strcmp(argv[i], "--ref")) reference = true;
+    else if (!strcmp(argv[i], "--stats")) stats = true;
+    else return usage();
+  }
+  if (i >= argc) return usage();
+
+  const char* path = argv[i++];
+  FILE* fp = fopen(path, "rb");
+  if (!fp) {
+    fprintf(stderr, "lesp: cannot read %s\n", path);
+    return 1;
+  }
+
+  const char* slash = strrchr(path, '/');
+  std::string sd_path;
+  if (sd_root) {
+    SD.set_root(sd_root);
+  } else {
+    SD.set_root(slash ? std::string(path, slash - path) : ".");
+    sd_path = std::string("/") + (slash ? slash + 1 : path);
+  }
+
+  std::vector<String> args;
+  for (; i < argc; i++) args.push_back(argv[i]);
+
+  init_builtin_libs();
+  term_sink = print_to_stdout;
+  term_start();
+
+  bool failed;
+  {
+    File f(fp, path);
+    Lesp vm(f.size());
+    vm.reference = reference;
+    if (sd_path.empty()) {
+      FileReader src(f);
+      vm.run_program(&src, args);
+    } else {
+      vm.run_file(f, sd_path, args);
+    }
+    failed = vm.failed;
+
+    if (stats) {
+      HeapStats& hs = vm.heap->stats;
+      fprintf(stderr, "heap: %u bytes live, %u peak, %u collections\n",
+              (unsigned)hs.bytes, (unsigned)hs.peak, (unsigned)hs.cycles);
+    }
+  }
+
+  term_sync();
+  fflush(stdout);
+  return failed ? 1 : 0;
+}
@@ -1,108 +1,432 @@
 #include "http_lib.h"
+#include "vm.h"
+#include "gc.h"
+#include "writer.h"
 #include <HTTPClient.h>
 #include <WiFiClient.h>
 #include <WiFiClientSecure.h>
 #include <SD.h>
 #include <Arduino.h>
 
-HttpState httpState;
+static const char HTTP_HANDLE[] = "http";
 
-Value b_http_get(const std::vector<Value>& a, Env*) {
-  if (a.empty() || a[0].type != V_STRING)
-    return Value::String("");
+static HttpState& http_state() {
+  return Lesp::current->state<HttpState>("http");
+}
 
-  const String url = a[0].str.c_str();
-  HTTPClient http;
-  bool https = url.startsWith("https://");
+static void drop(HttpConn& c) {
+  c.client->stop();
+  delete c.http;
+  delete c.client;
+}
 
-  if (https) {
-    WiFiClientSecure* client = new WiFiClientSecure();
-    client->setInsecure();
+HttpState::~HttpState() {
+  for (HttpConn& c : idle) drop(c);
+}
+
+void HttpState::trace(Heap& h) {
+  h.mark(response);
+}
 
-    if (!http.begin(*client, url)) {
-      delete client;
-      return Value::String("");
+HttpConn HttpState::acquire(const std::string& origin) {
+  uint32_t now = millis();
+  HttpConn found = { origin, nullptr, nullptr, 0 };
+  for (size_t i = 0; i < idle.size();) {
+    HttpConn& c = idle[i];
+    bool stale = now - c.idle_since >= HTTP_IDLE_MS || !c.client->connected();
+    if (stale || (!found.client && c.origin == origin)) {
+      if (stale) drop(c);
+      else found = c;
+      idle.erase(idle.begin() + i);
+    } else {
+      i++;
     }
+  }
+  if (found.client) return found;
+  if (origin.compare(0, 8, "https://") == 0) {
+    WiFiClientSecure* secure = new WiFiClientSecure();
+    secure->setInsecure();
+    found.client = secure;
   } else {
-    WiFiClient client;
-    if (!http.begin(client, url))
-      return Value::String("");
+    found.client = new WiFiClient();
   }
+  found.http = new HTTPClient();
+  return found;
+}
 
-  int code = http.GET();
-  httpState.status = code;
+void HttpState::release(HttpConn conn) {
+  if (idle.size() >= HTTP_POOL_SIZE) {
+    drop(idle.front());
+    idle.erase(idle.begin());
+  }
+  conn.idle_since = millis();
+  idle.push_back(std::move(conn));
+}
 
-  if (code <= 0) {
-    http.end();
-    return Value::String("");
+// "scheme://host:port" of a URL, which is what a pooled connection is
+// matched on.
+static std::string origin_of(const String& url) {
+  const char* u = url.c_str();
+  const char* host = strstr(u, "://");
+  const char* path = strchr(host ? host + 3 : u, '/');
+  return path ? std::string(u, path - u) : std::string(u);
+}
+
+// One request and its response body, read straight off the connection:
+// Content-Length bytes, the chunked transfer coding, or everything up to
+// the server closing the connection. `remaining` counts down the body or,
+// when chunked, the current chunk; it is -1 when the length is unknown.
+//
+// The connection comes from the script's pool and goes back to it as soon
+// as the body has been read to the end and the server lets it stay open.
+// One closed early is dropped instead, along with whatever is unread.
+struct HttpStream : HandleObj {
+  HttpState* pool = nullptr;
+  HttpConn conn = { std::string(), nullptr, nullptr, 0 };
+  WiFiClient* stream = nullptr;
+  int remaining = 0;
+  bool chunked = false;
+  bool in_chunk = false;
+  bool done = true;
+  bool complete = false;
+  uint32_t last_data = 0;
+
+  HttpStream() : HandleObj(HTTP_HANDLE) {}
+  ~HttpStream() {
+    close();
+  }
+  size_t footprint() const override {
+    return sizeof(HttpStream) + sizeof(HTTPClient) + sizeof(WiFiClientSecure);
+  }
+
+  // Sends a GET for `url`, from byte `offset` on if that is not 0, and
+  // reads the response headers. Returns the status code, or a negative
+  // HTTPC_ERROR_* if there is no response.
+  int open(const String& url, size_t offset = 0) {
+    pool = &http_state();
+    conn = pool->acquire(origin_of(url));
+    bool reused = conn.client->connected();
+    int status = request(url, offset);
+    // The server may have closed an idle connection just as it was reused.
+    if (status <= 0 && reused) {
+      conn.client->stop();
+      conn.http->end();
+      status = request(url, offset);
+    }
+    if (status <= 0) return status;
+    stream = conn.http->getStreamPtr();
+    chunked = conn.http->header("Transfer-Encoding").indexOf("chunked") >= 0;
+    remaining = chunked ? 0 : conn.http->getSize();
+    done = !chunked && (remaining == 0 || status == 204 || status == 304);
+    complete = done;
+    last_data = millis();
+    if (complete) release();
+    return status;
+  }
+
+  // Reads up to `n` bytes of the body. With `wait` it blocks until at
+  // least one arrives; without, it takes only what has arrived already,
+  // which may be nothing. `done` is set at the end of the body, or once the
+  // server has sent nothing for HTTP_TIMEOUT_MS; `complete` only in the
+  // first case.
+  size_t read(uint8_t* buf, size_t n, bool wait) {
+    if (done) return 0;
+    if (chunked && remaining == 0 && !next_chunk()) {
+      done = true;
+      return 0;
+    }
+    if (remaining >= 0 && (size_t)remaining < n) n = remaining;
+
+    size_t got = take(buf, n);
+    if (!got && wait && stream->readBytes(buf, 1) == 1) got = 1 + take(buf + 1, n - 1);
+
+    if (got) {
+      last_data = millis();
+      if (remaining > 0) remaining -= got;
+      if (!chunked && remaining == 0) done = complete = true;
+    } else if (wait || !conn.http->connected()) {
+      done = true;
+      complete = remaining < 0 && !conn.http->connected();
+    } else if (millis() - last_data >= HTTP_TIMEOUT_MS) {
+      done = true;
+    }
+    if (complete) release();
+    return got;
+  }
+
+  size_t read_bytes(char* buf, size_t n) override {
+    return read(reinterpret_cast<uint8_t*>(buf), n, true);
+  }
+
+  // Reads until `n` bytes are in or the body ends.
+  size_t read_full(uint8_t* buf, size_t n) {
+    size_t got = 0;
+    while (got < n && !done) got += read(buf + got, n - got, true);
+    return got;
+  }
+
+  // Stops the connection before ending the request, so a body left unread
+  // is dropped rather than drained.
+  void close() {
+    done = true;
+    if (!conn.client) return;
+    drop(conn);
+    conn.client = nullptr;
+    conn.http = nullptr;
+    stream = nullptr;
+  }
+
+private:
+  int request(const String& url, size_t offset) {
+    HTTPClient& http = *conn.http;
+    if (!http.begin(*conn.client, url)) return HTTPC_ERROR_CONNECTION_REFUSED;
+    static const char* keys[] = { "Transfer-Encoding" };
+    http.collectHeaders(keys, 1);
+    http.setReuse(true);
+    if (offset) http.addHeader("Range", "bytes=" + String((unsigned long)offset) + "-");
+    return http.GET();
+  }
+
+  // Ends the request with its body fully read. HTTPClient leaves the
+  // connection open only if the server agreed to keep it alive; either way
+  // the stream lets go of both, so nothing here can reach a pooled
+  // connection once another request has it.
+  void release() {
+    if (!conn.client) return;
+    conn.http->end();
+    if (conn.client->connected()) pool->release(std::move(conn));
+    else drop(conn);
+    conn.client = nullptr;
+    conn.http = nullptr;
+    stream = nullptr;
   }
 
-  String payload = http.getString();
-  httpState.response = payload;
-  http.end();
-  return Value::String(payload.c_str());
+  size_t take(uint8_t* buf, size_t n) {
+    int avail = stream->available();
+    if (avail <= 0 || !n) return 0;
+    int r = stream->read(buf, std::min(n, (size_t)avail));
+    return r > 0 ? r : 0;
+  }
+
+  bool read_line(std::string& line) {
+    line.clear();
+    uint8_t c;
+    while (stream->readBytes(&c, 1) == 1) {
+      if (c == '\n') return true;
+      if (c != '\r') line += (char)c;
+    }
+    return false;
+  }
+
+  // Moves on to the next chunk of a chunked body; false at its end.
+  bool next_chunk() {
+    std::string line;
+    if (in_chunk && (!read_line(line) || !line.empty())) return false;
+    in_chunk = true;
+    if (!read_line(line)) return false;
+    remaining = strtoul(line.c_str(), nullptr, 16);
+    if (remaining > 0) return true;
+    while (read_line(line) && !line.empty()) {}
+    complete = true;
+    release();
+    return false;
+  }
+};
+
+static HttpStream* stream_arg(const std::vector<Value>& args) {
+  if (args.empty() || args[0].type != V_HANDLE) return nullptr;
+  HandleObj* h = static_cast<HandleObj*>(args[0].obj);
+  return h->kind == HTTP_HANDLE ? static_cast<HttpStream*>(h) : nullptr;
 }
 
-Value b_http_get_file(const std::vector<Value>& a, Env*) {
-  if (a.size() < 2 || a[0].type != V_STRING || a[1].type != V_STRING)
-    return Value::Int(0);
+static size_t chunk_arg(const std::vector<Value>& args, size_t i) {
+  if (args.size() <= i) return HTTP_CHUNK;
+  int n = (int)args[i].num();
+  return n < 1 ? 1 : std::min((size_t)n, HTTP_MAX_CHUNK);
+}
 
-  const String url = a[0].str.c_str();
-  const String path = a[1].str.c_str();
+// Reads the whole body into the returned string, which http.response
+// keeps as well. It blocks the script, every task in it included, until
+// the body is in; a task that must not hold the others up reads with
+// http.open and http.read, which sleep only the task.
+Value b_http_get(const std::vector<Value>& a, Env*) {
+  if (a.empty() || a[0].type != V_STRING)
+    return Value::String("");
 
-  HTTPClient http;
-  WiFiClientSecure client;
-  client.setInsecure();
+  Lesp* l = Lesp::current;
+  HttpState& state = http_state();
+  state.response = Value::Nil();
+  l->flush_output();
+  HttpStream req;
+  state.status = req.open(a[0].str().c_str());
+  if (state.status <= 0) return Value::String("");
 
-  if (!http.begin(client, url))
-    return Value::Int(0);
+  std::string body;
+  if (req.remaining > 0) body.reserve(req.remaining);
+  while (!req.done && !l->kill_requested()) {
+    size_t at = body.size();
+    size_t want = req.remaining > 0 ? req.remaining : HTTP_CHUNK;
+    body.resize(at + want);
+    body.resize(at + req.read_full(reinterpret_cast<uint8_t*>(&body[at]), want));
+  }
+  state.response = Value::String(std::move(body));
+  return state.response;
+}
 
-  int code = http.GET();
-  httpState.status = code;
+// (http.stream url f [size]) calls (f chunk) for each `size` bytes of the
+// body as they arrive, and returns the status. Other tasks do not run
+// until it returns: f is called from C++, where nothing can suspend.
+Value b_http_stream(const std::vector<Value>& a, Env* env) {
+  if (a.size() < 2 || a[0].type != V_STRING) return Value::Int(0);
 
-  if (code != HTTP_CODE_OK) {
-    http.end();
-    return Value::Int(0);
+  Lesp* l = Lesp::current;
+  HttpState& state = http_state();
+  size_t size = chunk_arg(a, 2);
+  Value fn = a[1];
+  state.response = Value::Nil();
+  l->flush_output();
+  HttpStream req;
+  state.status = req.open(a[0].str().c_str());
+  if (state.status <= 0) return Value::Int(state.status);
+
+  std::string chunk;
+  std::vector<Value> args(1);
+  while (!req.done && !l->halted && !l->kill_requested()) {
+    chunk.resize(size);
+    chunk.resize(req.read_full(reinterpret_cast<uint8_t*>(&chunk[0]), size));
+    if (chunk.empty()) continue;
+    args[0] = Value::String(chunk);
+    apply(fn, args, env);
   }
+  return Value::Int(state.status);
+}
 
-  File f = SD.open(path, FILE_WRITE);
-  if (!f) {
-    http.end();
-    return Value::Int(0);
+// (http.open url) sends the request and returns a handle to read the body
+// from, or nil if there was no response. The status is in http.status.
+Value b_http_open(const std::vector<Value>& a, Env*) {
+  if (a.empty() || a[0].type != V_STRING) return Value::Nil();
+
+  Lesp* l = Lesp::current;
+  HttpState& state = http_state();
+  state.response = Value::Nil();
+  l->flush_output();
+  HttpStream* req = l->heap->make<HttpStream>();
+  state.status = req->open(a[0].str().c_str());
+  if (state.status <= 0) {
+    req->close();
+    return Value::Nil();
   }
+  return Value::Handle(req);
+}
+
+// (http.read h [n]) returns up to n bytes of the body, or nil at its end.
+// A task waiting for data sleeps meanwhile; elsewhere the call blocks.
+Value b_http_read(const std::vector<Value>& a, Env*) {
+  HttpStream* req = stream_arg(a);
+  if (!req || req->done) return Value::Nil();
+
+  std::string out(chunk_arg(a, 1), '\0');
+  uint8_t* buf = reinterpret_cast<uint8_t*>(&out[0]);
+  size_t got = req->read(buf, out.size(), false);
+  if (!got && !req->done) {
+    if (Lesp::current->vm->sleep(HTTP_POLL_MS, true)) return Value::Nil();
+    got = req->read(buf, out.size(), true);
+  }
+  if (!got) return Value::Nil();
+  out.resize(got);
+  return Value::String(std::move(out));
+}
+
+Value b_http_close(const std::vector<Value>& a, Env*) {
+  if (HttpStream* req = stream_arg(a)) req->close();
+  return Value::Nil();
+}
 
-  WiFiClient* stream = http.getStreamPtr();
-  uint8_t buf[256];
+// (http.get-file url path [resume [progress]]) saves the body to `path`
+// and returns 1 if all of it arrived and was written. While one block is
+// written to SD by a writer task, the next is read from the network. With
+// `resume`, a partial file is continued from where it ends using a Range
+// request. (progress done total) is called after each block; `total` is
+// -1 when the server does not say. http.transfer has the throughput.
+// Like http.get, it holds up the script's other tasks for the whole
+// download.
+Value b_http_get_file(const std::vector<Value>& a, Env* env) {
+  if (a.size() < 2 || a[0].type != V_STRING || a[1].type != V_STRING)
+    return Value::Int(0);
 
-  int remaining = http.getSize();
+  Lesp* l = Lesp::current;
+  HttpState& state = http_state();
+  const char* path = a[1].str().c_str();
+  bool resume = a.size() > 2 && a[2].i;
+  Value progress = a.size() > 3 ? a[3] : Value::Nil();
+  state.response = Value::Nil();
+  state.transfer_bytes = 0;
+  state.transfer_ms = 0;
+  l->flush_output();
+
+  size_t offset = 0;
+  if (resume) {
+    File old = SD.open(path);
+    if (old) offset = old.size();
+  }
+  HttpStream req;
+  state.status = req.open(a[0].str().c_str(), offset);
+  if (offset && state.status == HTTP_CODE_RANGE_NOT_SATISFIABLE) return Value::Int(1);
+  bool append = offset && state.status == HTTP_CODE_PARTIAL_CONTENT;
+  if (state.status != HTTP_CODE_OK && !append) return Value::Int(0);
+  if (!append) offset = 0;
+  int total = req.chunked || req.remaining < 0 ? -1 : offset + req.remaining;
 
-  while (http.connected() && (remaining > 0 || remaining == -1)) {
-    size_t avail = stream->available();
-    if (avail) {
-      Serial.print(5);
-      int read = stream->readBytes(buf, min(avail, sizeof(buf)));
-      f.write(buf, read);
-      if (remaining > 0) remaining -= read;
+  BlockWriter writer;
+  if (!writer.begin(SD.open(path, append ? FILE_APPEND : FILE_WRITE))) return Value::Int(0);
+
+  uint32_t start = millis();
+  size_t received = 0;
+  std::vector<Value> args(2);
+  while (!req.done && !l->halted && !l->kill_requested()) {
+    uint8_t* buf = writer.buffer();
+    if (!buf) break;
+    size_t n = req.read_full(buf, WRITE_BLOCK);
+    if (n) writer.submit(n);
+    received += n;
+    state.transfer_bytes = received;
+    state.transfer_ms = millis() - start;
+    if (progress.type == V_FUNC || progress.type == V_LAMBDA) {
+      args[0] = Value::Int(offset + received);
+      args[1] = Value::Int(total);
+      apply(progress, args, env);
     }
-    delay(1);
   }
 
-  f.close();
-  http.end();
-  return Value::Int(1);
+  bool written = writer.finish();
+  state.transfer_ms = millis() - start;
+  return Value::Int(req.complete && written);
+}
+
+// (http.transfer) is (bytes ms bytes-per-second) for the last get-file.
+Value b_http_transfer(const std::vector<Value>&, Env*) {
+  HttpState& state = http_state();
+  uint32_t rate = state.transfer_ms ? (uint64_t)state.transfer_bytes * 1000 / state.transfer_ms : 0;
+  return Value::List({ Value::Int(state.transfer_bytes), Value::Int(state.transfer_ms), Value::Int(rate) });
 }
 
 Value b_http_status(const std::vector<Value>&, Env*) {
-  return Value::Int(httpState.status);
+  return Value::Int(http_state().status);
 }
 
 Value b_http_response(const std::vector<Value>&, Env*) {
-  return Value::String(httpState.response.c_str());
+  const Value& r = http_state().response;
+  return r.type == V_STRING ? r : Value::String("");
 }
 
 void load_http_lib(Env* env) {
   env->define("get", Value::Func(b_http_get));
   env->define("get-file", Value::Func(b_http_get_file));
+  env->define("stream", Value::Func(b_http_stream));
+  env->define("open", Value::Func(b_http_open));
+  env->define("read", Value::Func(b_http_read));
+  env->define("close", Value::Func(b_http_close));
+  env->define("transfer", Value::Func(b_http_transfer));
   env->define("status", Value::Func(b_http_status));
   env->define("response", Value::Func(b_http_response));
-}
\ No newline at end of file
+}
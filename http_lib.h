@@ -3,13 +3,59 @@
 
 #include "interpreter.h"
 
-struct HttpState {
-  int status = 0;
-  String response;
+class WiFiClient;
+class HTTPClient;
+
+// Bytes http.read returns when not told how many, and the size of the
+// chunks http.stream hands to its callback. A body streamed either way
+// never needs more than one chunk of RAM.
+constexpr size_t HTTP_CHUNK = 512;
+constexpr size_t HTTP_MAX_CHUNK = 4096;
+
+// How long a read waits for the server to send more before giving up, and
+// how often a task suspended in http.read looks for data. http.read is
+// the only call that suspends; http.get, http.stream and http.get-file
+// block the whole script until the body is in.
+constexpr uint32_t HTTP_TIMEOUT_MS = 5000;
+constexpr uint32_t HTTP_POLL_MS = 10;
+
+// Idle keep-alive connections a script holds on to, and how long one may
+// sit unused. A TLS connection keeps its session buffers, so few.
+constexpr size_t HTTP_POOL_SIZE = 2;
+constexpr uint32_t HTTP_IDLE_MS = 30000;
+
+// A connection whose last response was read to the end, kept open for the
+// next request to the same scheme, host and port. The HTTPClient that
+// made the request goes with it: after end() it still points at the
+// connection and stops it when destroyed, so the two live and die
+// together.
+struct HttpConn {
+  std::string origin;
+  WiFiClient* client;
+  HTTPClient* http;
+  uint32_t idle_since;
 };
 
-extern HttpState httpState;
+// Status of the script's last request, the body http.get returned (the
+// same string, not a copy), how much the last get-file received and in
+// how long, and the idle connections, which are closed with the script.
+struct HttpState : LibState {
+  int status = 0;
+  Value response;
+  size_t transfer_bytes = 0;
+  uint32_t transfer_ms = 0;
+  std::vector<HttpConn> idle;
+
+  ~HttpState();
+  void trace(Heap& h) override;
+  // An idle connection to `origin` if one is still open, else a new
+  // unconnected client. The caller owns it until it is given back.
+  HttpConn acquire(const std::string& origin);
+  // Takes back a connection that is still open, dropping the longest idle
+  // one if the pool is full.
+  void release(HttpConn conn);
+};
 
 void load_http_lib(Env* env);
 
-#endif
\ No newline at end of file
+#endif
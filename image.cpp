@@ -0,0 +1,293 @@
+#include "image.h"
+#include <algorithm>
+#include <cstring>
+
+// Layout, all integers little-endian:
+//
+//   header   "LSC" IMAGE_VERSION:u16 size:u32 mtime:u32 checksum:u32
+//   symbols  count:u16 { len:u16 bytes }
+//   chunks   count:u32 { proto }
+//   proto    nparams:u16 nslots:u16 len:u32 code
+//            count:u16 { const }  count:u16 { proto }
+//   const    V_INT i32 | V_FLOAT f64 | V_STRING len:u32 bytes
+//
+// The checksum is FNV-1a over everything after the header. Symbol operands
+// in the stored code are indices into the symbol table.
+static const char kMagic[3] = {'L', 'S', 'C'};
+static const size_t kHeaderSize = 17;
+
+static const uint32_t kChecksumSeed = 2166136261u;
+
+static uint32_t checksum(uint32_t h, const uint8_t* p, size_t n) {
+  for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+static uint32_t le32(const uint8_t* p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+namespace {
+
+struct Writer {
+  std::string out;
+  std::vector<uint16_t> local;
+  std::vector<SymbolId> syms;
+
+  void u8(uint8_t v) {
+    out.push_back((char)v);
+  }
+  void u16(uint16_t v) {
+    u8(v);
+    u8(v >> 8);
+  }
+  void u32(uint32_t v) {
+    u16(v);
+    u16(v >> 16);
+  }
+  void bytes(const void* p, size_t n) {
+    out.append(static_cast<const char*>(p), n);
+  }
+
+  uint16_t symbol(SymbolId id) {
+    if (id >= local.size()) local.resize(id + 1);
+    if (!local[id]) {
+      syms.push_back(id);
+      local[id] = syms.size();
+    }
+    return local[id] - 1;
+  }
+
+  void proto(const Proto* p) {
+    u16(p->nparams);
+    u16(p->nslots);
+    u32(p->code.size());
+    size_t at = out.size();
+    bytes(p->code.data(), p->code.size());
+    for (size_t pc = 0; pc < p->code.size(); pc += op_size(p->code[pc])) {
+      for (size_t i = 0; i < op_symbols(p->code[pc]); i++) {
+        uint8_t* operand = reinterpret_cast<uint8_t*>(&out[at + pc + 1 + 2 * i]);
+        uint16_t s = symbol(operand[0] | operand[1] << 8);
+        operand[0] = s;
+        operand[1] = s >> 8;
+      }
+    }
+
+    u16(p->consts.size());
+    for (const Value& c : p->consts) {
+      u8(c.type);
+      if (c.type == V_INT) {
+        u32(c.i);
+      } else if (c.type == V_FLOAT) {
+        bytes(&c.f, sizeof(double));
+      } else {
+        u32(c.str().size());
+        bytes(c.str().data(), c.str().size());
+      }
+    }
+
+    u16(p->protos.size());
+    for (const Proto* child : p->protos) proto(child);
+  }
+};
+
+// Streams the image body in SOURCE_BLOCK reads, checksumming as it goes,
+// so an image never has to fit in RAM whole.
+struct Reader {
+  File& file;
+  uint8_t buf[SOURCE_BLOCK];
+  size_t pos = 0;
+  size_t len = 0;
+  uint32_t sum = kChecksumSeed;
+  std::vector<SymbolId> syms;
+  bool ok = true;
+
+  explicit Reader(File& f) : file(f) {}
+
+  bool bytes(void* dst, size_t n) {
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    while (ok && n) {
+      if (pos == len) {
+        len = file.read(buf, sizeof(buf));
+        pos = 0;
+        if (!len) ok = false;
+        sum = checksum(sum, buf, len);
+        continue;
+      }
+      size_t k = std::min(n, len - pos);
+      memcpy(out, buf + pos, k);
+      pos += k;
+      out += k;
+      n -= k;
+    }
+    return ok;
+  }
+  uint8_t u8() {
+    uint8_t v = 0;
+    bytes(&v, 1);
+    return v;
+  }
+  uint16_t u16() {
+    uint16_t lo = u8();
+    return lo | u8() << 8;
+  }
+  uint32_t u32() {
+    uint32_t lo = u16();
+    return lo | (uint32_t)u16() << 16;
+  }
+  // A byte count, which a damaged image could make absurdly large.
+  size_t length() {
+    uint32_t n = u32();
+    if (n > file.size()) ok = false;
+    return ok ? n : 0;
+  }
+  bool at_end() {
+    return ok && pos == len && !file.available();
+  }
+
+  // Rewrites symbol operands to this run's ids and checks that every
+  // instruction and constant or proto index is in range.
+  bool relink(Proto* f) {
+    std::vector<uint8_t>& code = f->code;
+    for (size_t pc = 0; pc < code.size();) {
+      uint8_t op = code[pc];
+      size_t n = op_size(op);
+      if (!n || pc + n > code.size()) return false;
+      uint16_t arg = n > 1 ? code[pc + n - 2] | code[pc + n - 1] << 8 : 0;
+      for (size_t i = 0; i < op_symbols(op); i++) {
+        uint8_t* operand = &code[pc + 1 + 2 * i];
+        uint16_t s = operand[0] | operand[1] << 8;
+        if (s >= syms.size()) return false;
+        operand[0] = syms[s];
+        operand[1] = syms[s] >> 8;
+      }
+      if ((op == OP_CONST && arg >= f->consts.size()) ||
+                 (op == OP_ERROR && (arg >= f->consts.size() || f->consts[arg].type != V_STRING)) ||
+                 (op == OP_CLOSURE && arg >= f->protos.size())) {
+        return false;
+      }
+      pc += n;
+    }
+    return true;
+  }
+
+  Proto* proto() {
+    Proto* f = new Proto;
+    f->nparams = u16();
+    f->nslots = u16();
+    f->code.resize(length());
+    bytes(f->code.data(), f->code.size());
+
+    uint16_t nconsts = u16();
+    f->consts.reserve(nconsts);
+    for (uint16_t i = 0; ok && i < nconsts; i++) {
+      uint8_t type = u8();
+      if (type == V_INT) {
+        f->consts.push_back(Value::Int((int32_t)u32()));
+      } else if (type == V_FLOAT) {
+        double d = 0;
+        bytes(&d, sizeof(double));
+        f->consts.push_back(Value::Float(d));
+      } else if (type == V_STRING) {
+        std::string str(length(), '\0');
+        if (bytes(&str[0], str.size())) f->consts.push_back(Value::String(std::move(str)));
+      } else {
+        ok = false;
+      }
+    }
+
+    uint16_t nprotos = u16();
+    f->protos.reserve(nprotos);
+    for (uint16_t i = 0; ok && i < nprotos; i++) f->protos.push_back(proto());
+
+    if (!ok || !relink(f)) {
+      ok = false;
+      delete f;
+      return nullptr;
+    }
+    return f;
+  }
+};
+
+}  // namespace
+
+ImageKey image_key(File& src) {
+  return ImageKey{(uint32_t)src.size(), (uint32_t)src.getLastWrite()};
+}
+
+std::string image_path(const std::string& src_path) {
+  size_t dot = src_path.rfind('.');
+  size_t slash = src_path.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return src_path + ".lsc";
+  return src_path.substr(0, dot) + ".lsc";
+}
+
+bool image_read(const char* path, const ImageKey& key, std::vector<Proto*>& out) {
+  File f = SD.open(path);
+  if (!f) return false;
+
+  // The header alone settles whether the image is current, so a stale one
+  // costs a single small read.
+  uint8_t h[kHeaderSize];
+  if (f.read(h, kHeaderSize) != kHeaderSize || memcmp(h, kMagic, sizeof(kMagic)) ||
+      (h[3] | h[4] << 8) != IMAGE_VERSION || le32(h + 5) != key.size || le32(h + 9) != key.mtime) {
+    f.close();
+    return false;
+  }
+
+  Reader r(f);
+  uint16_t nsyms = r.u16();
+  r.syms.reserve(nsyms);
+  std::string name;
+  for (uint16_t i = 0; r.ok && i < nsyms; i++) {
+    name.resize(r.u16());
+    if (r.bytes(&name[0], name.size())) r.syms.push_back(intern(name));
+  }
+
+  std::vector<Proto*> chunks;
+  uint32_t nchunks = r.u32();
+  for (uint32_t i = 0; r.ok && i < nchunks; i++)
+    if (Proto* c = r.proto()) chunks.push_back(c);
+
+  bool ok = r.at_end() && r.sum == le32(h + 13);
+  f.close();
+  if (!ok) {
+    for (Proto* c : chunks) delete c;
+    return false;
+  }
+  out.insert(out.end(), chunks.begin(), chunks.end());
+  return true;
+}
+
+bool image_write(const char* path, const ImageKey& key, const std::vector<Proto*>& chunks) {
+  Writer body;
+  body.u32(chunks.size());
+  for (const Proto* c : chunks) body.proto(c);
+
+  Writer w;
+  w.bytes(kMagic, sizeof(kMagic));
+  w.u16(IMAGE_VERSION);
+  w.u32(key.size);
+  w.u32(key.mtime);
+  size_t sum_at = w.out.size();
+  w.u32(0);
+  w.u16(body.syms.size());
+  for (SymbolId id : body.syms) {
+    const std::string& name = symbol_name(id);
+    w.u16(name.size());
+    w.bytes(name.data(), name.size());
+  }
+  w.bytes(body.out.data(), body.out.size());
+
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(w.out.data());
+  uint32_t sum = checksum(kChecksumSeed, data + kHeaderSize, w.out.size() - kHeaderSize);
+  for (int i = 0; i < 4; i++) w.out[sum_at + i] = (char)(sum >> (8 * i));
+
+  File f = SD.open(path, FILE_WRITE);
+  if (!f) return false;
+  size_t written = f.write(data, w.out.size());
+  f.close();
+  if (written == w.out.size()) return true;
+  SD.remove(path);
+  return false;
+}
@@ -0,0 +1,31 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "vm.h"
+#include <string>
+#include <vector>
+
+// Compiled scripts cached on the SD card. The image of "/name.txt" is
+// "/name.lsc": the bytecode of the script's top-level forms, in order, with
+// symbols stored by name since ids are only meaningful within one run. It
+// records the size and modification time of the source it was compiled
+// from, and is ignored once either changes.
+constexpr uint16_t IMAGE_VERSION = 2;  // bump whenever the bytecode changes
+
+struct ImageKey {
+  uint32_t size;
+  uint32_t mtime;
+};
+
+ImageKey image_key(File& src);
+std::string image_path(const std::string& src_path);
+
+// Appends the chunks of the image at `path` to `out`. Returns false, with
+// `out` untouched, if there is no image or it does not match `key`.
+bool image_read(const char* path, const ImageKey& key, std::vector<Proto*>& out);
+
+// Saves `chunks` as the image at `path`. Returns false if it could not be
+// written in full, in which case no image is left behind.
+bool image_write(const char* path, const ImageKey& key, const std::vector<Proto*>& chunks);
+
+#endif
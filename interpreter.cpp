@@ -1,10 +1,22 @@
 #include "interpreter.h"
+#include "vm.h"
+#include "gc.h"
+#include "image.h"
 #include "math_lib.h"
 #include "sys_lib.h"
 #include "fs_lib.h"
 #include "wifi_lib.h"
 #include "http_lib.h"
+#include "co_lib.h"
+#include "json_lib.h"
+#include "map_lib.h"
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 
 std::map<std::string, LibLoader> builtin_libs;
@@ -23,24 +35,44 @@ Value Value::Float(double v) {
   return x;
 }
 
+template <typename T, typename... Args>
+static T* alloc(Args&&... args) {
+  Heap* heap = current_heap();
+  return heap ? heap->make<T>(std::forward<Args>(args)...) : new T(std::forward<Args>(args)...);
+}
+
 Value Value::String(const std::string& s) {
   Value x;
   x.type = V_STRING;
-  x.str = s;
+  x.obj = alloc<StringObj>(s);
+  return x;
+}
+
+Value Value::String(std::string&& s) {
+  Value x;
+  x.type = V_STRING;
+  x.obj = alloc<StringObj>(std::move(s));
   return x;
 }
 
 Value Value::Symbol(const std::string& s) {
   Value x;
   x.type = V_SYMBOL;
-  x.str = s;
+  x.sym = intern(s);
+  return x;
+}
+
+Value Value::List(const ValueList& v) {
+  Value x;
+  x.type = V_LIST;
+  x.obj = alloc<ListObj>(v);
   return x;
 }
 
-Value Value::List(const std::vector<Value>& v) {
+Value Value::List(ValueList&& v) {
   Value x;
   x.type = V_LIST;
-  x.list = v;
+  x.obj = alloc<ListObj>(std::move(v));
   return x;
 }
 
@@ -51,102 +83,283 @@ Value Value::Func(BuiltinFn f) {
   return x;
 }
 
+Value Value::Lib(Env* env) {
+  Value x;
+  x.type = V_LIB;
+  x.lib_env = env;
+  return x;
+}
+
+Value Value::Handle(HandleObj* h) {
+  Value x;
+  x.type = V_HANDLE;
+  x.obj = h;
+  return x;
+}
+
+Value Value::Map() {
+  Value x;
+  x.type = V_MAP;
+  x.obj = alloc<MapObj>();
+  return x;
+}
+
 Value Value::Nil() {
   return Value();
 }
 
 Env::Env(Env* p) : parent(p) {
-  if (parent)
+  if (parent && !parent->shared())
     loaded_libs = parent->loaded_libs;
   else
     loaded_libs = new std::set<std::string>();
 }
 
+Env::~Env() {
+  if (!parent || parent->shared()) delete loaded_libs;
+}
+
+bool Env::get(SymbolId k, Value& out) {
+  Value* v = lookup(k);
+  if (!v) return false;
+  out = *v;
+  return true;
+}
+
 bool Env::get(const std::string& k, Value& out) {
-  if (vars.count(k)) {
-    out = vars[k];
-    return true;
+  return get(intern(k), out);
+}
+
+bool Env::set_existing(SymbolId k, const Value& v) {
+  for (Env* e = this; e; e = e->parent) {
+    if (Value* slot = e->find(k)) {
+      if (e->shared()) define(k, v);
+      else *slot = v;
+      return true;
+    }
   }
-  if (parent) return parent->get(k, out);
   return false;
 }
 
-bool Env::set_existing(const std::string& k, const Value& v) {
-  if (vars.count(k)) {
-    vars[k] = v;
-    return true;
+void Env::define(SymbolId k, const Value& v) {
+  if (Value* slot = find(k)) {
+    *slot = v;
+    return;
   }
-  if (parent) return parent->set_existing(k, v);
-  return false;
+  if (k >= index.size()) index.resize(k + 1, 0);
+  vals.push_back(v);
+  index[k] = vals.size();
 }
 
 void Env::define(const std::string& k, const Value& v) {
-  vars[k] = v;
+  define(intern(k), v);
+}
+
+static std::mutex symbol_lock;
+static std::deque<std::string> symbol_names;
+static std::unordered_map<std::string, SymbolId> symbol_ids;
+
+SymbolId intern(const std::string& name) {
+  std::lock_guard<std::mutex> guard(symbol_lock);
+  auto it = symbol_ids.find(name);
+  if (it != symbol_ids.end()) return it->second;
+  SymbolId id = symbol_names.size();
+  symbol_names.push_back(name);
+  symbol_ids[name] = id;
+  return id;
 }
 
-Parser::Parser(const char* s) : src(s) {}
+const std::string& symbol_name(SymbolId id) {
+  std::lock_guard<std::mutex> guard(symbol_lock);
+  return symbol_names[id];
+}
+
+Parser::Parser(const char* s, Arena* a) : src(s), end(s + strlen(s)), reader(nullptr), arena(a) {}
+
+Parser::Parser(SourceReader* r, Arena* a) : reader(r), arena(a), block(SOURCE_BLOCK + 1) {
+  src = end = block.data();
+  block[0] = 0;
+}
+
+// Makes `n` bytes visible at src, refilling the block from the reader, and
+// reports whether the source had that many left.
+bool Parser::ensure(size_t n) {
+  if ((size_t)(end - src) >= n) return true;
+  if (!reader) return false;
+
+  char* base = block.data();
+  size_t have = end - src;
+  memmove(base, src, have);
+  while (have < n) {
+    size_t got = reader->read(base + have, SOURCE_BLOCK - have);
+    if (!got) break;
+    have += got;
+  }
+  base[have] = 0;
+  src = base;
+  end = base + have;
+  return have >= n;
+}
+
+// Appends characters to `token` until `stop` accepts one or the source
+// ends, across block boundaries.
+template <typename Stop>
+void Parser::scan(Stop stop) {
+  token.clear();
+  while (ensure(1)) {
+    const char* start = src;
+    while (src < end && !stop(*src)) src++;
+    token.append(start, src);
+    if (src < end) return;
+  }
+}
 
 void Parser::skip() {
-  while (*src == ' ' || *src == '\n' || *src == '\t') src++;
+  for (char c = peek(); c == ' ' || c == '\n' || c == '\t'; c = peek()) src++;
 }
 
 bool Parser::eof() {
   skip();
-  return *src == 0;
+  return peek() == 0;
 }
 
 Value Parser::parse() {
   skip();
-  if (*src == '(') {
+  char c = peek();
+  if (c == '(') {
     src++;
-    std::vector<Value> items;
+    size_t from = scratch.size();
     while (true) {
       skip();
-      if (*src == ')') {
+      c = peek();
+      if (c == ')') {
         src++;
         break;
       }
-      items.push_back(parse());
+      if (!c) break;
+      scratch.push_back(parse());
     }
-    return Value::List(items);
+    Value x;
+    x.type = V_LIST;
+    if (arena)
+      x.obj = arena->make<ListObj>(scratch.data() + from, scratch.data() + scratch.size(), arena);
+    else
+      x.obj = alloc<ListObj>(scratch.data() + from, scratch.data() + scratch.size(), nullptr);
+    scratch.resize(from);
+    return x;
   }
 
-  if (*src == '"') {
+  if (c == '"') {
     src++;
-    const char* start = src;
-    while (*src && *src != '"') src++;
-    std::string s(start, src);
-    if (*src == '"') src++;
-    return Value::String(s);
+    scan([](char ch) { return ch == '"'; });
+    if (peek() == '"') src++;
+    if (!arena) return Value::String(token);
+    Value x;
+    x.type = V_STRING;
+    x.obj = arena->make<StringObj>(token);
+    return x;
   }
 
-  if ((*src >= '0' && *src <= '9') || (*src == '-' && src[1] >= '0')) {
+  // Numbers are short; 64 bytes of lookahead lets strtod run on the block.
+  if ((c >= '0' && c <= '9') || (c == '-' && ensure(2) && src[1] >= '0')) {
+    ensure(64);
     char* endptr;
     double val = strtod(src, &endptr);
-    src = endptr;
-    if (std::floor(val) == val)
-      return Value::Int((int)val);
-    else
-      return Value::Float(val);
+    if (endptr != src) {
+      src = endptr;
+      if (std::floor(val) == val)
+        return Value::Int((int)val);
+      else
+        return Value::Float(val);
+    }
   }
 
-  const char* start = src;
-  while (*src && *src != ' ' && *src != '\n' && *src != ')') src++;
-  return Value::Symbol(std::string(start, src));
+  scan([](char ch) { return ch == ' ' || ch == '\n' || ch == ')'; });
+  return Value::Symbol(token);
 }
 
-Value apply(Value fn, const std::vector<Value>& args, Env* env) {
+static Value eval(const Value& expr, Env* env, bool tail);
+
+static bool halted() {
+  return Lesp::current && (Lesp::current->halted || Lesp::current->kill_requested());
+}
+
+// Builtins called from C++ can never suspend the task, as the caller would
+// carry on before the task resumed. A reference-mode body ending in a call
+// leaves it in tail_fn and tail_args, and the loop here makes it without
+// growing the stack.
+Value apply(const Value& fn, const std::vector<Value>& args, Env* env) {
+  if (Lesp::current) Lesp::current->vm->suspendable = false;
   if (fn.type == V_FUNC) return fn.fn(args, env);
+  if (fn.type == V_LAMBDA && fn.lambda->proto && Lesp::current)
+    return Lesp::current->vm->call(fn, args, env);
   if (fn.type == V_LAMBDA) {
-    Env local(fn.lambda->env);
-    for (size_t i = 0; i < fn.lambda->params.size(); i++)
-      local.define(fn.lambda->params[i], args[i]);
-    return eval(*fn.lambda->body, &local);
+    Lesp* L = Lesp::current;
+    if (L && L->eval_depth >= MAX_EVAL_DEPTH) {
+      L->error("stack overflow");
+      return Value::Nil();
+    }
+    if (L) L->eval_depth++;
+    Value callee = fn;
+    std::vector<Value> callee_args;
+    const std::vector<Value>* a = &args;
+    Value r;
+    for (;;) {
+      Env local(callee.lambda->env);
+      const std::vector<SymbolId>& params = callee.lambda->params;
+      for (size_t i = 0; i < params.size(); i++)
+        local.define(params[i], i < a->size() ? (*a)[i] : Value::Nil());
+      r = eval(callee.lambda->body, &local, true);
+      while (L && L->recurring) {
+        L->recurring = false;
+        for (size_t i = 0; i < params.size(); i++)
+          local.define(params[i], i < L->recur_args.size() ? L->recur_args[i] : Value::Nil());
+        r = eval(callee.lambda->body, &local, true);
+      }
+      if (!L || !L->tail_calling) break;
+      L->tail_calling = false;
+      callee = L->tail_fn;
+      callee_args = std::move(L->tail_args);
+      a = &callee_args;
+      if (halted()) {
+        r = Value::Nil();
+        break;
+      }
+    }
+    if (L) L->eval_depth--;
+    return r;
   }
   return Value::Nil();
 }
 
-Value eval(Value expr, Env* env) {
+bool symbol_list(const Value& v) {
+  if (v.type != V_LIST) return false;
+  for (const Value& item : v.list())
+    if (item.type != V_SYMBOL) return false;
+  return true;
+}
+
+// (name init name init ...): every other item is a name.
+bool loop_bindings(const Value& v) {
+  if (v.type != V_LIST) return false;
+  const ValueList& b = v.list();
+  for (size_t i = 0; i < b.size(); i += 2)
+    if (b[i].type != V_SYMBOL) return false;
+  return true;
+}
+
+static Value bad_form(const char* msg) {
+  if (Lesp::current) Lesp::current->error(msg);
+  return Value::Nil();
+}
+
+Value eval(const Value& expr, Env* env) {
+  return eval(expr, env, false);
+}
+
+// `tail` is set for the last expression of a lambda body, and passed on to
+// the branches of if and the last form of begin.
+static Value eval(const Value& expr, Env* env, bool tail) {
   switch (expr.type) {
     case V_INT:
     case V_FLOAT:
@@ -155,14 +368,15 @@ Value eval(Value expr, Env* env) {
     case V_LAMBDA: return expr;
     case V_SYMBOL:
       {
-        size_t dot = expr.str.find('.');
+        const std::string& name = symbol_name(expr.sym);
+        size_t dot = name.find('.');
         if (dot != std::string::npos) {
-          std::string lib = expr.str.substr(0, dot);
-          std::string sym = expr.str.substr(dot + 1);
+          std::string lib = name.substr(0, dot);
+          std::string sym = name.substr(dot + 1);
 
           Value libVal;
           if (!env->get(lib, libVal)) return Value::Nil();
-          if (!libVal.lib_env) return Value::Nil();
+          if (libVal.type != V_LIB) return Value::Nil();
 
           Value out;
           if (libVal.lib_env->get(sym, out)) return out;
@@ -170,49 +384,95 @@ Value eval(Value expr, Env* env) {
         }
 
         Value out;
-        if (env->get(expr.str, out)) return out;
+        if (env->get(expr.sym, out)) return out;
         return Value::Nil();
       }
 
     case V_LIST:
       {
-        if (expr.list.empty()) return Value::Nil();
-        Value head = expr.list[0];
-
-        if (head.type == V_SYMBOL && head.str == "def") {
-          Value v = eval(expr.list[2], env);
-          env->define(expr.list[1].str, v);
+        const ValueList& items = expr.list();
+        if (items.empty()) return Value::Nil();
+        const Value& head = items[0];
+        static const std::string none;
+        const std::string& form = head.type == V_SYMBOL ? symbol_name(head.sym) : none;
+
+        if (form == "def") {
+          Value v = items.size() > 2 ? eval(items[2], env) : Value::Nil();
+          if (items.size() > 1 && items[1].type == V_SYMBOL) env->define(items[1].sym, v);
           return v;
         }
 
-        if (head.type == V_SYMBOL && head.str == "set!") {
-          Value v = eval(expr.list[2], env);
-          env->set_existing(expr.list[1].str, v);
+        if (form == "set!") {
+          if (items.size() > 1 && items[1].type != V_SYMBOL) return bad_form("bad set! target");
+          Value v = items.size() > 2 ? eval(items[2], env) : Value::Nil();
+          if (items.size() < 2) return v;
+          const std::string& name = symbol_name(items[1].sym);
+          size_t dot = name.find('.');
+          if (dot == std::string::npos)
+            env->set_existing(items[1].sym, v);
+          else
+            set_member(env, intern(name.substr(0, dot)), intern(name.substr(dot + 1)), v);
           return v;
         }
 
-        if (head.type == V_SYMBOL && head.str == "begin") {
+        if (form == "begin") {
           Env local(env);
           Value r = Value::Nil();
-          for (size_t i = 1; i < expr.list.size(); i++)
-            r = eval(expr.list[i], &local);
+          for (size_t i = 1; i < items.size(); i++)
+            r = eval(items[i], &local, tail && i + 1 == items.size());
           return r;
         }
 
-        if (head.type == V_SYMBOL && head.str == "if") {
-          return eval(expr.list[1], env).i ? eval(expr.list[2], env) : eval(expr.list[3], env);
+        if (form == "if") {
+          return eval(items[1], env).i ? eval(items[2], env, tail) : eval(items[3], env, tail);
         }
 
-        if (head.type == V_SYMBOL && head.str == "while") {
+        if (form == "while") {
           Value r = Value::Nil();
-          while (eval(expr.list[1], env).i) r = eval(expr.list[2], env);
+          while (eval(items[1], env).i && !halted()) r = eval(items[2], env);
           return r;
         }
 
-        if (head.type == V_SYMBOL && head.str == "lambda") {
-          Lambda* l = new Lambda();
-          for (auto& p : expr.list[1].list) l->params.push_back(p.str);
-          l->body = new Value(expr.list[2]);
+        if (form == "loop") {
+          if (items.size() > 1 && !loop_bindings(items[1])) return bad_form("bad loop bindings");
+          Env local(env);
+          std::vector<SymbolId> names;
+          if (items.size() > 1) {
+            const ValueList& b = items[1].list();
+            for (size_t i = 0; i < b.size(); i += 2) {
+              local.define(b[i].sym, i + 1 < b.size() ? eval(b[i + 1], &local) : Value::Nil());
+              names.push_back(b[i].sym);
+            }
+          }
+          Lesp* L = Lesp::current;
+          Value r = items.size() > 2 ? eval(items[2], &local) : Value::Nil();
+          while (L && L->recurring && !L->halted && items.size() > 2) {
+            L->recurring = false;
+            for (size_t i = 0; i < names.size(); i++)
+              local.define(names[i], i < L->recur_args.size() ? L->recur_args[i] : Value::Nil());
+            r = eval(items[2], &local);
+          }
+          return r;
+        }
+
+        if (form == "recur") {
+          std::vector<Value> args;
+          args.reserve(items.size() - 1);
+          for (size_t i = 1; i < items.size(); i++)
+            args.push_back(eval(items[i], env));
+          if (Lesp::current) {
+            Lesp::current->recur_args = std::move(args);
+            Lesp::current->recurring = true;
+          }
+          return Value::Nil();
+        }
+
+        if (form == "lambda") {
+          if (items.size() > 1 && !symbol_list(items[1])) return bad_form("bad lambda parameters");
+          Lambda* l = alloc<Lambda>();
+          if (items.size() > 1)
+            for (auto& p : items[1].list()) l->params.push_back(p.sym);
+          l->body = items.size() > 2 ? items[2] : Value::Nil();
           l->env = env;
           Value v;
           v.type = V_LAMBDA;
@@ -220,78 +480,272 @@ Value eval(Value expr, Env* env) {
           return v;
         }
 
-        if (head.type == V_SYMBOL && head.str == "include") {
-          if (expr.list.size() < 2) return Value::Nil();
+        if (form == "include") {
+          if (items.size() < 2) return Value::Nil();
 
-          Value lib = expr.list[1];
+          Value lib = items[1];
           if (lib.type != V_SYMBOL) return Value::Nil();
-          const std::string& name = lib.str;
+          return include_lib(symbol_name(lib.sym), env);
+        }
+        Value fn = eval(head, env);
+        std::vector<Value> args;
+        args.reserve(items.size() - 1);
+        for (size_t i = 1; i < items.size(); i++)
+          args.push_back(eval(items[i], env));
+        if (halted()) return Value::Nil();
+        if (tail && fn.type == V_LAMBDA && !fn.lambda->proto && Lesp::current) {
+          Lesp::current->tail_fn = fn;
+          Lesp::current->tail_args = std::move(args);
+          Lesp::current->tail_calling = true;
+          return Value::Nil();
+        }
+        return apply(fn, args, env);
+      }
+    default: return Value::Nil();
+  }
+}
 
-          if (env->loaded_libs->count(name)) return Value::Nil();
-          env->loaded_libs->insert(name);
+static void define_lib(Env* env, const std::string& name, Env* lib_env) {
+  env->define(name, Value::Lib(lib_env));
+  if (Heap* heap = current_heap()) heap->barrier(env);
+}
 
-          if (name == "core") return Value::Nil();
+// Core and the builtin libraries, built by init_builtin_libs().
+static std::unique_ptr<Env> core_env;
+static std::map<std::string, std::unique_ptr<Env>> shared_libs;
 
-          if (builtin_libs.count(name)) {
-            Env* lib_env = new Env(env);
-            builtin_libs[name](lib_env);
+static std::unique_ptr<Env> make_shared(LibLoader load) {
+  std::unique_ptr<Env> env(new Env());
+  load(env.get());
+  env->mark = MARK_SHARED;
+  return env;
+}
 
-            Value libValue;
-            libValue.type = V_SYMBOL;
-            libValue.str = name;
-            libValue.lib_env = lib_env;
+// Builtin libraries are shared, so one is only ever copied into a script's
+// heap when the script assigns to a member. SD libraries can read and set
+// the includer's globals and are loaded afresh for every run.
+Value include_lib(const std::string& name, Env* env) {
+  if (env->loaded_libs->count(name)) return Value::Nil();
+  env->loaded_libs->insert(name);
 
-            env->define(name, libValue);
-            return Value::Nil();
-          }
+  if (name == "core") return Value::Nil();
 
-          std::string path = "/" + name + ".txt";
-          File f = SD.open(path.c_str());
-          if (!f) return Value::Nil();
+  auto shared = shared_libs.find(name);
+  if (shared != shared_libs.end()) {
+    define_lib(env, name, shared->second.get());
+    return Value::Nil();
+  }
 
-          String src;
-          while (f.available()) {
-            char c = f.read();
-            if (c != '\r') src += c;
-          }
-          f.close();
+  std::string path = "/" + name + ".txt";
+  File f = SD.open(path.c_str());
+  if (!f) return Value::Nil();
+
+  Env* lib_env = alloc<Env>(env);
+  define_lib(env, name, lib_env);
+  if (Lesp::current) {
+    Lesp::current->exec_file(f, path, lib_env);
+  } else {
+    FileReader src(f);
+    Parser p(&src);
+    while (!p.eof()) eval(p.parse(), lib_env);
+  }
+  return Value::Nil();
+}
 
-          Env* lib_env = new Env(env);
-          Parser p(src.c_str());
-          while (!p.eof()) eval(p.parse(), lib_env);
+// (set! lib.name v). Only existing members can be rebound.
+void set_member(Env* env, SymbolId lib, SymbolId name, const Value& v) {
+  Env* owner = env->where(lib);
+  if (!owner) return;
+  Value& binding = *owner->find(lib);
+  if (binding.type != V_LIB || !binding.lib_env->find(name)) return;
+
+  Env* lib_env = binding.lib_env;
+  Heap* heap = current_heap();
+  if (lib_env->shared()) {
+    Env* copy = alloc<Env>(owner);
+    copy->vals = lib_env->vals;
+    copy->index = lib_env->index;
+    if (heap) heap->resized(copy);
+    binding = Value::Lib(copy);
+    if (heap) heap->barrier(owner);
+    lib_env = copy;
+  }
+  *lib_env->find(name) = v;
+  if (heap) heap->barrier(lib_env);
+}
 
-          Value libValue;
-          libValue.type = V_SYMBOL;
-          libValue.str = name;
-          libValue.lib_env = lib_env;
+thread_local Lesp* Lesp::current = nullptr;
 
-          env->define(name, libValue);
-          return Value::Nil();
-        }
-        Value fn = eval(head, env);
-        std::vector<Value> args;
-        for (size_t i = 1; i < expr.list.size(); i++)
-          args.push_back(eval(expr.list[i], env));
-        return apply(fn, args, env);
-      }
-    default: return Value::Nil();
+// The arena's chunk size scales with the source so a typical form parses
+// out of the first block.
+Lesp::Lesp(size_t src_len) : global(core_env.get()), heap(new Heap(this)), vm(new VM(this)), arena(new Arena(std::min<size_t>(16 * 1024, std::max<size_t>(1024, src_len * 4)))) {
+  current = this;
+}
+
+Lesp::~Lesp() {
+  flush_output();
+  if (current == this) current = nullptr;
+  for (Proto* p : chunks) delete p;
+  delete vm;
+  delete heap;
+  delete arena;
+}
+
+void Lesp::run_program(const char* src, const std::vector<String>& args) {
+  Parser p(src, arena);
+  run_program(p, args);
+}
+
+void Lesp::run_program(SourceReader* src, const std::vector<String>& args) {
+  Parser p(src, arena);
+  run_program(p, args);
+}
+
+static void load_core(Lesp& l) {
+  if (!l.global.parent) load_core_lib(&l.global);
+  l.global.loaded_libs->insert("core");
+}
+
+static void call_main(Lesp& l, const std::vector<String>& args) {
+  Value mainFn;
+  if (!l.halted && l.global.get("main", mainFn) && mainFn.type == V_LAMBDA) {
+    std::vector<Value> argValues;
+    for (auto& s : args)
+      argValues.push_back(Value::String(s.c_str()));
+
+    apply(mainFn, argValues, &l.global);
+  }
+}
+
+// What the shell does with a script: load core, run its top-level forms,
+// then call (main args...) if it defined one. Tasks it spawned run whenever
+// the main code sleeps or waits, and after it is done until they are too.
+void Lesp::run_program(Parser& p, const std::vector<String>& args) {
+  load_core(*this);
+  exec(p, &global);
+  call_main(*this, args);
+  vm->drain();
+}
+
+void Lesp::run_file(File f, const std::string& path, const std::vector<String>& args) {
+  load_core(*this);
+  exec_file(f, path, &global);
+  call_main(*this, args);
+  vm->drain();
+}
+
+void Lesp::exec(const char* src, Env* env) {
+  Parser p(src, arena);
+  exec(p, env);
+}
+
+void Lesp::exec(Parser& p, Env* env, std::vector<Proto*>* compiled) {
+  while (!halted && !p.eof()) {
+    Arena::Mark m = arena->mark();
+    Value form = p.parse();
+    if (reference) {
+      eval(form, env);
+      continue;
+    }
+    Proto* chunk = compile(form);
+    arena->rewind(m);
+    chunks.push_back(chunk);
+    if (compiled) compiled->push_back(chunk);
+    vm->run(chunk, env);
+  }
+}
+
+// Runs the script open as `f` from its image when there is a current one.
+// Otherwise the source is parsed, and if every form ran the chunks are saved
+// as the image for next time.
+void Lesp::exec_file(File f, const std::string& path, Env* env) {
+  if (reference) {
+    FileReader src(f);
+    Parser p(&src, arena);
+    exec(p, env);
+    return;
+  }
+
+  ImageKey key = image_key(f);
+  std::string image = image_path(path);
+  size_t first = chunks.size();
+  if (image_read(image.c_str(), key, chunks)) {
+    f.close();
+    size_t last = chunks.size();
+    for (size_t i = first; i < last && !halted; i++) vm->run(chunks[i], env);
+    return;
+  }
+
+  std::vector<Proto*> compiled;
+  {
+    FileReader src(f);
+    Parser p(&src, arena);
+    exec(p, env, &compiled);
   }
+  if (!halted) image_write(image.c_str(), key, compiled);
 }
 
-Lesp::Lesp() {}
+void Lesp::mark_roots() {
+  heap->root(&global);
+  for (Proto* p : chunks) heap->mark(p);
+  vm->mark(*heap);
+  for (auto& s : lib_state) s.second->trace(*heap);
+}
+
+// The reference evaluator keeps its environments, arguments and the form
+// being run on the C stack, out of the collector's sight, so it never
+// collects.
+void Lesp::collect() {
+  if (reference) return;
+  heap->collect();
+}
 
-void Lesp::run_script(const char* src) {
-  Parser p(src);
-  while (!p.eof()) eval(p.parse(), &global);
+// Reports a runtime error on the terminal and stops the script the same
+// way sys.exit does.
+void Lesp::error(const std::string& msg) {
+  flush_output();
+  std::string line = "error: " + msg + "\n";
+  term_write(line.data(), line.size(), ST77XX_RED);
+  halted = true;
+  failed = true;
 }
 
+void Lesp::write(const char* s, size_t n) {
+  pending_output.append(s, n);
+  size_t end = pending_output.rfind('\n');
+  if (end != std::string::npos) {
+    term_write(pending_output.data(), end + 1);
+    pending_output.erase(0, end + 1);
+  }
+  if (pending_output.size() >= MAX_PENDING_OUTPUT) flush_output();
+}
+
+// Lets the script's other tasks run meanwhile if it can, otherwise blocks
+// the whole script, waking up now and then to check for a kill.
+void Lesp::sleep(uint32_t ms) {
+  if (vm->sleep(ms)) return;
+  flush_output();
+  while (ms > 0 && !kill_requested()) {
+    uint32_t slice = std::min(ms, DELAY_SLICE_MS);
+    delay(slice);
+    ms -= slice;
+  }
+}
+
+// Called before anything that may block for a while, so a prompt printed
+// without a newline is on the screen while the script waits.
+void Lesp::flush_output() {
+  if (pending_output.empty()) return;
+  term_write(pending_output.data(), pending_output.size());
+  pending_output.clear();
+}
 
 Value b_add(const std::vector<Value>& a, Env*) {
   bool is_float = false;
   double sum = 0;
   for (auto& v : a) {
     if (v.type == V_FLOAT) is_float = true;
-    sum += (v.type == V_INT) ? v.i : v.f;
+    sum += v.num();
   }
   return is_float ? Value::Float(sum) : Value::Int((int)sum);
 }
@@ -299,11 +753,11 @@ Value b_add(const std::vector<Value>& a, Env*) {
 Value b_sub(const std::vector<Value>& a, Env*) {
   if (a.empty()) return Value::Int(0);
   bool is_float = false;
-  double r = (a[0].type == V_INT) ? a[0].i : a[0].f;
+  double r = a[0].num();
   if (a[0].type == V_FLOAT) is_float = true;
   for (size_t i = 1; i < a.size(); i++) {
     if (a[i].type == V_FLOAT) is_float = true;
-    r -= (a[i].type == V_INT) ? a[i].i : a[i].f;
+    r -= a[i].num();
   }
   return is_float ? Value::Float(r) : Value::Int((int)r);
 }
@@ -313,34 +767,34 @@ Value b_mul(const std::vector<Value>& a, Env*) {
   double r = 1;
   for (auto& v : a) {
     if (v.type == V_FLOAT) is_float = true;
-    r *= (v.type == V_INT) ? v.i : v.f;
+    r *= v.num();
   }
   return is_float ? Value::Float(r) : Value::Int((int)r);
 }
 
 Value b_div(const std::vector<Value>& a, Env*) {
   if (a.empty()) return Value::Int(0);
-  double r = (a[0].type == V_INT) ? a[0].i : a[0].f;
+  double r = a[0].num();
   for (size_t i = 1; i < a.size(); i++)
-    r /= (a[i].type == V_INT) ? a[i].i : a[i].f;
+    r /= a[i].num();
   return Value::Float(r);
 }
 
 Value b_lt(const std::vector<Value>& a, Env*) {
-  double x = (a[0].type == V_INT) ? a[0].i : a[0].f;
-  double y = (a[1].type == V_INT) ? a[1].i : a[1].f;
+  double x = a[0].num();
+  double y = a[1].num();
   return Value::Int(x < y);
 }
 
 Value b_lte(const std::vector<Value>& a, Env*) {
-  double x = (a[0].type == V_INT) ? a[0].i : a[0].f;
-  double y = (a[1].type == V_INT) ? a[1].i : a[1].f;
+  double x = a[0].num();
+  double y = a[1].num();
   return Value::Int(x <= y);
 }
 
 Value b_gte(const std::vector<Value>& a, Env*) {
-  double x = (a[0].type == V_INT) ? a[0].i : a[0].f;
-  double y = (a[1].type == V_INT) ? a[1].i : a[1].f;
+  double x = a[0].num();
+  double y = a[1].num();
   return Value::Int(x >= y);
 }
 
@@ -349,57 +803,79 @@ Value b_eq(const std::vector<Value>& a, Env*) {
   if (a[0].type != a[1].type) return Value::Int(0);
   if (a[0].type == V_INT) return Value::Int(a[0].i == a[1].i);
   if (a[0].type == V_FLOAT) return Value::Int(a[0].f == a[1].f);
-  if (a[0].type == V_STRING) return Value::Int(a[0].str == a[1].str);
+  if (a[0].type == V_STRING) return Value::Int(a[0].str() == a[1].str());
   return Value::Int(0);
 }
 
-Value b_println(const std::vector<Value>& a, Env*) {
-  for (auto& v : a) {
-    if (v.type == V_INT) {
-      String s = String(v.i);
-      for (char c : s) termPutChar(c);
-    } else if (v.type == V_FLOAT) {
-      String s = String(v.f);
-      for (char c : s) termPutChar(c);
-    } else if (v.type == V_STRING) {
-      for (char c : v.str) termPutChar(c);
+// Collects the output of one print call so it reaches the terminal in as
+// few writes as possible; numbers are formatted in place.
+struct PrintBuffer {
+  char buf[128];
+  size_t n = 0;
+
+  void put(const char* s, size_t len) {
+    if (n + len > sizeof(buf)) {
+      flush();
+      if (len > sizeof(buf)) {
+        emit(s, len);
+        return;
+      }
     }
+    memcpy(buf + n, s, len);
+    n += len;
+  }
+
+  void put(const Value& v) {
+    char num[32];
+    if (v.type == V_INT) put(num, snprintf(num, sizeof(num), "%d", v.i));
+    else if (v.type == V_FLOAT) put(num, snprintf(num, sizeof(num), "%.2f", v.f));
+    else if (v.type == V_STRING) put(v.str().data(), v.str().size());
+  }
+
+  void flush() {
+    if (n) emit(buf, n);
+    n = 0;
   }
-  termPutChar('\n');
+
+  static void emit(const char* s, size_t len) {
+    if (Lesp::current) Lesp::current->write(s, len);
+    else term_write(s, len);
+  }
+};
+
+Value b_println(const std::vector<Value>& a, Env*) {
+  PrintBuffer out;
+  for (auto& v : a) out.put(v);
+  out.put("\n", 1);
+  out.flush();
   return Value::Nil();
 }
 
 Value b_print(const std::vector<Value>& a, Env*) {
-  for (auto& v : a) {
-    if (v.type == V_INT) {
-      String s = String(v.i);
-      for (char c : s) termPutChar(c);
-    } else if (v.type == V_FLOAT) {
-      String s = String(v.f);
-      for (char c : s) termPutChar(c);
-    } else if (v.type == V_STRING) {
-      for (char c : v.str) termPutChar(c);
-    }
-  }
+  PrintBuffer out;
+  for (auto& v : a) out.put(v);
+  out.flush();
   return Value::Nil();
 }
 
 Value b_parse_int(const std::vector<Value>& args, Env*) {
   if (args.empty() || args[0].type != V_STRING)
     return Value::Int(0);
-  return Value::Int(atoi(args[0].str.c_str()));
+  return Value::Int(atoi(args[0].str().c_str()));
 }
 
 Value b_float(const std::vector<Value>& args, Env*) {
   if (args.empty()) return Value::Float(0.0);
   if (args[0].type == V_INT) return Value::Float((double)args[0].i);
   if (args[0].type == V_FLOAT) return args[0];
-  if (args[0].type == V_STRING) return Value::Float(atof(args[0].str.c_str()));
+  if (args[0].type == V_STRING) return Value::Float(atof(args[0].str().c_str()));
   return Value::Float(0.0);
 }
 
 Value b_string(const std::vector<Value>& args, Env*) {
   if (args.empty()) return Value::String("");
+  if (args[0].type == V_STRING && static_cast<StringObj*>(args[0].obj)->builder)
+    return Value::String(args[0].str());
   if (args[0].type == V_STRING) return args[0];
   if (args[0].type == V_INT) return Value::String(String(args[0].i).c_str());
   if (args[0].type == V_FLOAT) return Value::String(String(args[0].f).c_str());
@@ -413,8 +889,10 @@ Value b_type(const std::vector<Value>& args, Env*) {
     case V_FLOAT: return Value::String("float");
     case V_STRING: return Value::String("string");
     case V_LIST: return Value::String("list");
+    case V_MAP: return Value::String("map");
     case V_FUNC:
     case V_LAMBDA: return Value::String("function");
+    case V_HANDLE: return Value::String(static_cast<HandleObj*>(args[0].obj)->kind);
     default: return Value::String("nil");
   }
 }
@@ -442,41 +920,45 @@ Value b_get(const std::vector<Value>& args, Env*) {
   if (args.size() < 2) return Value::Nil();
   const Value& arr = args[0];
   int idx = args[1].i;
-  if (arr.type == V_LIST && idx >= 0 && idx < (int)arr.list.size())
-    return arr.list[idx];
+  if (arr.type == V_LIST && idx >= 0 && idx < (int)arr.list().size())
+    return arr.list()[idx];
   return Value::Nil();
 }
 
 Value b_list(const std::vector<Value>& args, Env*) {
-  return Value::List(args);
+  return Value::List(ValueList(args.begin(), args.end()));
 }
 
 Value b_set(const std::vector<Value>& args, Env*) {
   if (args.size() < 3) return Value::Nil();
-  Value arr = args[0];
-  if (arr.type != V_LIST) return Value::Nil();
+  if (args[0].type != V_LIST) return Value::Nil();
+  Value arr = Value::List(args[0].list());
   int idx = args[1].i;
-  if (idx >= 0 && idx < (int)arr.list.size()) arr.list[idx] = args[2];
+  if (idx >= 0 && idx < (int)arr.list().size()) arr.list()[idx] = args[2];
   return arr;
 }
 
 Value b_len(const std::vector<Value>& args, Env*) {
+  if (!args.empty() && args[0].type == V_MAP) return Value::Int(args[0].map().count);
   if (args.empty() || args[0].type != V_LIST) return Value::Int(0);
-  return Value::Int(args[0].list.size());
+  return Value::Int(args[0].list().size());
 }
 
 Value b_push(const std::vector<Value>& args, Env*) {
   if (args.size() < 2 || args[0].type != V_LIST) return Value::Nil();
-  Value arr = args[0];
-  arr.list.push_back(args[1]);
-  return arr;
+  const ValueList& src = args[0].list();
+  ValueList items;
+  items.reserve(src.size() + 1);
+  items.assign(src.begin(), src.end());
+  items.push_back(args[1]);
+  return Value::List(std::move(items));
 }
 
 Value b_pop(const std::vector<Value>& args, Env*) {
-  if (args.empty() || args[0].type != V_LIST || args[0].list.empty())
+  if (args.empty() || args[0].type != V_LIST || args[0].list().empty())
     return Value::Nil();
-  Value arr = args[0];
-  arr.list.pop_back();
+  Value arr = Value::List(args[0].list());
+  arr.list().pop_back();
   return arr;
 }
 
@@ -484,38 +966,42 @@ Value b_slice(const std::vector<Value>& args, Env*) {
   if (args.size() < 3 || args[0].type != V_LIST) return Value::Nil();
   int start = args[1].i;
   int end = args[2].i;
-  const auto& list = args[0].list;
+  const auto& list = args[0].list();
   if (start < 0) start = 0;
   if (end > (int)list.size()) end = list.size();
-  std::vector<Value> result(list.begin() + start, list.begin() + end);
-  return Value::List(result);
+  if (start > end) start = end;
+  return Value::List(ValueList(list.begin() + start, list.begin() + end));
 }
 
 Value b_strlen(const std::vector<Value>& args, Env*) {
   if (args.empty() || args[0].type != V_STRING) return Value::Int(0);
-  return Value::Int(args[0].str.length());
+  return Value::Int(args[0].str().length());
 }
 
 Value b_concat(const std::vector<Value>& args, Env*) {
+  size_t n = 0;
+  for (auto& v : args)
+    if (v.type == V_STRING) n += v.str().size();
   std::string result;
+  result.reserve(n);
   for (auto& v : args) {
-    if (v.type == V_STRING) result += v.str;
+    if (v.type == V_STRING) result += v.str();
   }
-  return Value::String(result);
+  return Value::String(std::move(result));
 }
 
 Value b_substr(const std::vector<Value>& args, Env*) {
   if (args.size() < 3 || args[0].type != V_STRING) return Value::String("");
   int start = args[1].i;
   int len = args[2].i;
-  return Value::String(args[0].str.substr(start, len));
+  return Value::String(args[0].str().substr(start, len));
 }
 
 Value b_charAt(const std::vector<Value>& args, Env*) {
   if (args.size() < 2 || args[0].type != V_STRING) return Value::String("");
   int idx = args[1].i;
-  if (idx >= 0 && idx < (int)args[0].str.length()) {
-    return Value::String(std::string(1, args[0].str[idx]));
+  if (idx >= 0 && idx < (int)args[0].str().length()) {
+    return Value::String(std::string(1, args[0].str()[idx]));
   }
   return Value::String("");
 }
@@ -524,9 +1010,9 @@ Value b_split(const std::vector<Value>& args, Env*) {
   if (args.size() < 2 || args[0].type != V_STRING || args[1].type != V_STRING)
     return Value::List({});
 
-  std::vector<Value> result;
-  std::string str = args[0].str;
-  std::string delim = args[1].str;
+  ValueList result;
+  const std::string& str = args[0].str();
+  const std::string& delim = args[1].str();
 
   size_t start = 0;
   size_t end = str.find(delim);
@@ -538,7 +1024,63 @@ Value b_split(const std::vector<Value>& args, Env*) {
   }
   result.push_back(Value::String(str.substr(start)));
 
-  return Value::List(result);
+  return Value::List(std::move(result));
+}
+
+// In-place variants of push/pop/set and an appendable string. They change
+// the object every reference shares, in amortized O(1).
+static void mutated(Obj* o) {
+  if (Heap* heap = current_heap()) {
+    heap->barrier(o);
+    heap->resized(o);
+  }
+}
+
+Value b_push_in_place(const std::vector<Value>& args, Env*) {
+  if (args.size() < 2 || args[0].type != V_LIST) return Value::Nil();
+  ValueList& items = args[0].list();
+  for (size_t i = 1; i < args.size(); i++) items.push_back(args[i]);
+  mutated(args[0].obj);
+  return args[0];
+}
+
+Value b_pop_in_place(const std::vector<Value>& args, Env*) {
+  if (args.empty() || args[0].type != V_LIST || args[0].list().empty())
+    return Value::Nil();
+  ValueList& items = args[0].list();
+  Value last = items.back();
+  items.pop_back();
+  return last;
+}
+
+Value b_set_at(const std::vector<Value>& args, Env*) {
+  if (args.size() < 3 || args[0].type != V_LIST) return Value::Nil();
+  ValueList& items = args[0].list();
+  int idx = args[1].i;
+  if (idx < 0 || idx >= (int)items.size()) return Value::Nil();
+  items[idx] = args[2];
+  mutated(args[0].obj);
+  return args[0];
+}
+
+Value b_string_builder(const std::vector<Value>& args, Env*) {
+  Value sb = Value::String(!args.empty() && args[0].type == V_STRING ? args[0].str() : std::string());
+  static_cast<StringObj*>(sb.obj)->builder = true;
+  return sb;
+}
+
+Value b_sb_append(const std::vector<Value>& args, Env*) {
+  if (args.empty() || args[0].type != V_STRING) return Value::Nil();
+  StringObj* sb = static_cast<StringObj*>(args[0].obj);
+  if (!sb->builder) return Value::Nil();
+  for (size_t i = 1; i < args.size(); i++) {
+    const Value& v = args[i];
+    if (v.type == V_STRING) sb->str += v.str();
+    else if (v.type == V_INT) sb->str += String(v.i).c_str();
+    else if (v.type == V_FLOAT) sb->str += String(v.f).c_str();
+  }
+  mutated(sb);
+  return args[0];
 }
 
 void load_core_lib(Env* env) {
@@ -563,6 +1105,11 @@ void load_core_lib(Env* env) {
   env->define("len", Value::Func(b_len));
   env->define("push", Value::Func(b_push));
   env->define("pop", Value::Func(b_pop));
+  env->define("push!", Value::Func(b_push_in_place));
+  env->define("pop!", Value::Func(b_pop_in_place));
+  env->define("set-at!", Value::Func(b_set_at));
+  env->define("string-builder", Value::Func(b_string_builder));
+  env->define("sb-append", Value::Func(b_sb_append));
   env->define("slice", Value::Func(b_slice));
   env->define("strlen", Value::Func(b_strlen));
   env->define("concat", Value::Func(b_concat));
@@ -571,6 +1118,8 @@ void load_core_lib(Env* env) {
   env->define("split", Value::Func(b_split));
   env->define("print", Value::Func(b_print));
   env->define("println", Value::Func(b_println));
+  load_co_lib(env);
+  load_map_lib(env);
 }
 
 
@@ -580,4 +1129,9 @@ void init_builtin_libs() {
   builtin_libs["fs"] = load_fs_lib;
   builtin_libs["wifi"] = load_wifi_lib;
   builtin_libs["http"] = load_http_lib;
+  builtin_libs["json"] = load_json_lib;
+
+  if (!core_env) core_env = make_shared(load_core_lib);
+  for (auto& lib : builtin_libs)
+    if (!shared_libs.count(lib.first)) shared_libs[lib.first] = make_shared(lib.second);
 }
\ No newline at end of file
@@ -1,25 +1,26 @@
 #ifndef INTERPRETER_H
 #define INTERPRETER_H
 
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <map>
 #include <set>
 #include <string>
 #include <cmath>
+#include <cstdint>
 #include <SD.h>
 #include <Adafruit_GFX.h>
 #include <Adafruit_ST7735.h>
 #include <Arduino.h>
+#include "arena.h"
+#include "term.h"
+#include "source.h"
 
 extern Adafruit_ST7735 tft;
-extern int cursorX;
-extern int cursorY;
 extern SemaphoreHandle_t termMutex;
 
-void termPutChar(char c, uint16_t color = ST77XX_WHITE);
-void termBackspace();
-
-enum ValueType {
+enum ValueType : uint8_t {
   V_INT,
   V_FLOAT,
   V_STRING,
@@ -27,67 +28,357 @@ enum ValueType {
   V_LIST,
   V_FUNC,
   V_LAMBDA,
-  V_NIL
+  V_NIL,
+  V_LIB,
+  V_HANDLE,
+  V_MAP
 };
 
 struct Env;
 struct Value;
+struct Proto;
+struct Frame;
+struct VM;
+struct Heap;
 using BuiltinFn = Value (*)(const std::vector<Value>&, Env*);
 
-struct Lambda {
-  std::vector<std::string> params;
-  Value* body;
-  Env* env;
+// Every identifier is interned once by the parser; the interpreter compares
+// and indexes by id from then on.
+using SymbolId = uint16_t;
+
+SymbolId intern(const std::string& name);
+const std::string& symbol_name(SymbolId id);
+
+// Mark of objects built once at startup and shared read-only by every
+// running script. No heap owns, traces or frees them.
+constexpr uint32_t MARK_SHARED = 0xFFFFFFFF;
+
+// Header of every heap-allocated value. Objects are owned by the running
+// Lesp's Heap and reclaimed by its mark-sweep collector; `size` is the
+// footprint recorded when the heap adopted the object.
+struct Obj {
+  Obj* next = nullptr;
+  uint32_t mark = 0;
+  uint32_t size = 0;
+
+  bool shared() const {
+    return mark == MARK_SHARED;
+  }
+
+  virtual ~Obj() {}
+  virtual void trace(Heap&) {}
+  virtual size_t footprint() const {
+    return sizeof(Obj);
+  }
 };
 
+struct Lambda;
+struct HandleObj;
+struct MapObj;
+
+// List storage. Parse trees keep theirs in the script's arena; everything
+// built at run time uses the general heap.
+using ValueList = std::vector<Value, ArenaAllocator<Value>>;
+
+// 16 bytes on both the ESP32 and 64-bit hosts: immediates live inline,
+// strings, lists, closures and library handles are pointers. `i` sits
+// outside the union so every non-int value reads as 0 (false).
 struct Value {
   ValueType type = V_NIL;
   int i = 0;
-  double f = 0.0f;
-  std::string str;
-  std::vector<Value> list;
-  BuiltinFn fn = nullptr;
-  Lambda* lambda = nullptr;
-  Env* lib_env = nullptr;
+  union {
+    double f;
+    SymbolId sym;
+    BuiltinFn fn;
+    Obj* obj;
+    Lambda* lambda;
+    Env* lib_env;
+  };
+
+  Value() : f(0.0) {}
+
+  double num() const {
+    return type == V_INT ? i : type == V_FLOAT ? f : 0.0;
+  }
+
+  const std::string& str() const;
+  ValueList& list() const;
+  MapObj& map() const;
 
   static Value Int(int v);
   static Value Float(double v);
   static Value String(const std::string& s);
+  static Value String(std::string&& s);
   static Value Symbol(const std::string& s);
-  static Value List(const std::vector<Value>& v);
+  static Value List(const ValueList& v);
+  static Value List(ValueList&& v);
   static Value Func(BuiltinFn f);
+  static Value Lib(Env* env);
+  static Value Handle(HandleObj* h);
+  static Value Map();
   static Value Nil();
 };
 
+static_assert(sizeof(Value) == 16, "Value must stay a 16-byte tagged cell");
+
+// Strings are immutable except those made by string-builder, which
+// sb-append extends in place. `hash` is filled in the first time the
+// string is used as a map key (0 until then; never for builders).
+struct StringObj : Obj {
+  std::string str;
+  bool builder = false;
+  uint32_t hash = 0;
+
+  StringObj(const std::string& s) : str(s) {}
+  StringObj(std::string&& s) : str(std::move(s)) {}
+  size_t footprint() const override {
+    return sizeof(StringObj) + str.capacity();
+  }
+};
+
+struct ListObj : Obj {
+  ValueList items;
+
+  ListObj(const ValueList& v) : items(v) {}
+  ListObj(ValueList&& v) : items(std::move(v)) {}
+  ListObj(const Value* b, const Value* e, Arena* a) : items(b, e, ArenaAllocator<Value>(a)) {}
+  void trace(Heap& h) override;
+  size_t footprint() const override {
+    return sizeof(ListObj) + items.capacity() * sizeof(Value);
+  }
+};
+
+// Hash map from any value to any value. Strings and numbers are keys by
+// value, everything else by identity. `entries` keeps insertion order, which
+// is the order keys are listed and walked in; `index` is an open-addressed
+// table of positions in `entries`, probed linearly and kept at most 3/4
+// full. Every entry keeps its key's hash, so lookups compare hashes before
+// keys and growing never hashes a key again. A removed entry has hash 0 and
+// is dropped the next time the table is rebuilt.
+struct MapObj : Obj {
+  struct Entry {
+    Value key;
+    Value val;
+    uint32_t hash;
+  };
+  std::vector<Entry> entries;
+  std::vector<int32_t> index;
+  size_t count = 0;
+
+  // The value stored under `key`, or nullptr.
+  Value* find(const Value& key);
+  void set(const Value& key, const Value& val);
+  bool remove(const Value& key);
+  void trace(Heap& h) override;
+  size_t footprint() const override {
+    return sizeof(MapObj) + entries.capacity() * sizeof(Entry) + index.capacity() * sizeof(int32_t);
+  }
+
+private:
+  int32_t slot(const Value& key, uint32_t hash, size_t& at);
+  void rebuild(size_t size);
+};
+
+struct Lambda : Obj {
+  std::vector<SymbolId> params;
+  Value body;
+  Env* env = nullptr;
+  Proto* proto = nullptr;
+  Frame* frame = nullptr;
+
+  void trace(Heap& h) override;
+  size_t footprint() const override {
+    return sizeof(Lambda) + params.capacity() * sizeof(SymbolId);
+  }
+};
+
+// A native resource held by a script, such as an open file. `kind` names
+// it for `type` and lets library functions check what they were given. The
+// destructor releases the resource, so the collector closes handles a
+// script drops and the heap closes the rest when the script ends.
+struct HandleObj : Obj {
+  const char* kind;
+
+  explicit HandleObj(const char* k) : kind(k) {}
+  // Up to `n` bytes of the stream behind the handle, for readers that take
+  // any source; 0 at its end, or if the handle has none.
+  virtual size_t read_bytes(char*, size_t) {
+    return 0;
+  }
+};
+
+inline const std::string& Value::str() const {
+  return static_cast<StringObj*>(obj)->str;
+}
+
+inline ValueList& Value::list() const {
+  return static_cast<ListObj*>(obj)->items;
+}
+
+inline MapObj& Value::map() const {
+  return *static_cast<MapObj*>(obj);
+}
+
 using LibLoader = void (*)(Env*);
 extern std::map<std::string, LibLoader> builtin_libs;
 
-struct Env {
+// Module scope: the global environment and one per included library.
+// Bindings live in a flat array; `index` maps a symbol id to its position
+// + 1 (0 = unbound). Library envs live on the heap; the root env owns
+// `loaded_libs`. Core and the builtin libraries are shared envs: a script
+// assigning to one of their names gets its own binding (or, for a library
+// member, its own copy of the library) instead.
+struct Env : Obj {
   Env* parent;
-  std::map<std::string, Value> vars;
+  std::vector<Value> vals;
+  std::vector<uint16_t> index;
   std::set<std::string>* loaded_libs;
 
   Env(Env* p = nullptr);
+  ~Env();
+  void trace(Heap& h) override;
+  size_t footprint() const override {
+    return sizeof(Env) + vals.capacity() * sizeof(Value) + index.capacity() * sizeof(uint16_t);
+  }
+
+  Value* find(SymbolId k) {
+    if (k < index.size() && index[k]) return &vals[index[k] - 1];
+    return nullptr;
+  }
+
+  Value* lookup(SymbolId k) {
+    for (Env* e = this; e; e = e->parent)
+      if (Value* v = e->find(k)) return v;
+    return nullptr;
+  }
+
+  Env* where(SymbolId k) {
+    for (Env* e = this; e; e = e->parent)
+      if (e->find(k)) return e;
+    return nullptr;
+  }
+
+  bool get(SymbolId k, Value& out);
   bool get(const std::string& k, Value& out);
-  bool set_existing(const std::string& k, const Value& v);
+  bool set_existing(SymbolId k, const Value& v);
+  void define(SymbolId k, const Value& v);
   void define(const std::string& k, const Value& v);
 };
 
+// Nodes and string literals come from `arena` when one is given. List items
+// are gathered on `scratch` and copied out once the closing paren is seen.
+// The text between `src` and `end` is either the whole script or, when
+// reading from a SourceReader, the current block of it; either way it is
+// NUL-terminated.
 struct Parser {
   const char* src;
-  Parser(const char* s);
+  const char* end;
+  SourceReader* reader;
+  Arena* arena;
+  std::vector<char> block;
+  std::vector<Value> scratch;
+  std::string token;
+
+  Parser(const char* s, Arena* a = nullptr);
+  Parser(SourceReader* r, Arena* a = nullptr);
   void skip();
   bool eof();
   Value parse();
+
+private:
+  bool ensure(size_t n);
+  char peek() {
+    return src < end || ensure(1) ? *src : 0;
+  }
+  template <typename Stop>
+  void scan(Stop stop);
 };
 
-Value eval(Value expr, Env* env);
-Value apply(Value fn, const std::vector<Value>& args, Env* env);
+Value eval(const Value& expr, Env* env);
+Value apply(const Value& fn, const std::vector<Value>& args, Env* env);
+Value include_lib(const std::string& name, Env* env);
+void set_member(Env* env, SymbolId lib, SymbolId name, const Value& v);
+
+// Shape checks both evaluators make before trusting a special form.
+bool symbol_list(const Value& v);
+bool loop_bindings(const Value& v);
+
+// Reference-mode calls recurse through eval() on the task's C stack, all
+// but those in tail position, which apply() makes in a loop.
+constexpr size_t MAX_EVAL_DEPTH = 64;
+
+// Longest partial line a script's output holds back before writing it
+// anyway.
+constexpr size_t MAX_PENDING_OUTPUT = 128;
+
+// Longest stretch a blocking wait sleeps between checks for a kill.
+constexpr uint32_t DELAY_SLICE_MS = 20;
 
+// Per-run state of a builtin library, such as the last HTTP response.
+// Library envs are shared by every running script, so state that must not
+// leak from one script to another hangs off the Lesp instead. It is a GC
+// root, so values it keeps must be marked by trace().
+struct LibState {
+  virtual ~LibState() {}
+  virtual void trace(Heap&) {}
+};
+
+// Scripts are compiled to bytecode and run on the VM; setting `reference`
+// switches to the tree-walking eval() so results can be compared.
+//
+// Several can run at once on different tasks. Another task stops one by
+// setting `killed`, which the script notices at its next safepoint. Output
+// reaches the terminal a line at a time so concurrent scripts never mix
+// within a line.
 struct Lesp {
   Env global;
-  Lesp();
-  void run_script(const char* src);
+  Heap* heap;
+  VM* vm;
+  Arena* arena;
+  std::vector<Proto*> chunks;
+  bool reference = false;
+  bool halted = false;
+  bool failed = false;
+  size_t eval_depth = 0;
+  bool recurring = false;
+  std::vector<Value> recur_args;
+  bool tail_calling = false;
+  Value tail_fn;
+  std::vector<Value> tail_args;
+  std::atomic<bool> killed{false};
+  std::string pending_output;
+  std::map<std::string, std::unique_ptr<LibState>> lib_state;
+
+  static thread_local Lesp* current;
+
+  Lesp(size_t src_len = 0);
+  ~Lesp();
+  void run_program(const char* src, const std::vector<String>& args);
+  void run_program(SourceReader* src, const std::vector<String>& args);
+  void run_program(Parser& p, const std::vector<String>& args);
+  void run_file(File f, const std::string& path, const std::vector<String>& args);
+  void exec(const char* src, Env* env);
+  void exec(Parser& p, Env* env, std::vector<Proto*>* compiled = nullptr);
+  void exec_file(File f, const std::string& path, Env* env);
+  void mark_roots();
+  void collect();
+  void error(const std::string& msg);
+  void write(const char* s, size_t n);
+  void flush_output();
+  void sleep(uint32_t ms);
+
+  bool kill_requested() {
+    if (!killed.load(std::memory_order_relaxed)) return false;
+    halted = true;
+    return true;
+  }
+
+  template <typename T>
+  T& state(const std::string& lib) {
+    std::unique_ptr<LibState>& s = lib_state[lib];
+    if (!s) s.reset(new T());
+    return static_cast<T&>(*s);
+  }
 };
 
 void load_core_lib(Env* env);
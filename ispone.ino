@@ -15,6 +15,10 @@
 #include <HTTPClient.h>
 
 #include "interpreter.h"
+#include "gc.h"
+#include "term.h"
+#include "source.h"
+#include "jobs.h"
 #include "math_lib.h"
 #include "sys_lib.h"
 #include "fs_lib.h"
@@ -32,86 +36,102 @@ SPIClass hspi(HSPI);
 Adafruit_ST7735 tft(TFT_CS, TFT_DC, TFT_RST);
 
 String filename;
-int cursorX = 0;
-int cursorY = 0;
-constexpr int CHAR_W = 6;
-constexpr int CHAR_H = 8;
 String inputBuffer;
 
-void termPutChar(char c, uint16_t color) {
-  xSemaphoreTake(termMutex, portMAX_DELAY);
-  tft.setTextColor(color);
-  if (c == '\n') {
-    cursorX = 0;
-    cursorY += CHAR_H;
-  } else {
-    tft.setCursor(cursorX, cursorY);
-    tft.print(c);
-    cursorX += CHAR_W;
+// Job the shell is waiting on: the script just started in the foreground,
+// or the one named by `wait`. The prompt returns when it finishes.
+int foreground = -1;
 
-    if (cursorX + CHAR_W > tft.width()) {
-      cursorX = 0;
-      cursorY += CHAR_H;
-    }
-  }
-
-  if (cursorY + CHAR_H > tft.height()) {
-    tft.fillScreen(ST77XX_BLACK);
-    cursorX = 0;
-    cursorY = 0;
-  }
+void printShInit() {
+  term_write("$ ", 2, ST77XX_RED);
+}
 
-  xSemaphoreGive(termMutex);
+void shellPrint(const String& s, uint16_t color = ST77XX_WHITE) {
+  term_write(s.c_str(), s.length(), color);
 }
 
-void termBackspace() {
-  xSemaphoreTake(termMutex, portMAX_DELAY);
+void reportJob(const JobInfo& j) {
+  String line = "[" + String(j.id) + "] " + (j.killed ? "killed " : j.failed ? "failed " : "done ") + j.name + "\n";
+  shellPrint(line, ST77XX_YELLOW);
+}
 
-  if (cursorX >= CHAR_W) {
-    cursorX -= CHAR_W;
-  } else if (cursorY >= CHAR_H) {
-    cursorY -= CHAR_H;
-    cursorX = tft.width() - CHAR_W;
+void listJobs() {
+  for (const JobInfo& j : job_list()) {
+    String line = "[" + String(j.id) + "] " + (j.state == JOB_RUNNING ? "running " : "done ") + j.name + " " +
+                  String((unsigned long)(j.elapsed_ms / 1000)) + "s\n";
+    shellPrint(line);
   }
-
-  tft.fillRect(cursorX, cursorY, CHAR_W, CHAR_H, ST77XX_BLACK);
-
-  xSemaphoreGive(termMutex);
 }
 
-struct ScriptParam {
-  char* src;
-  std::vector<String> args;
-};
-
-void printShInit() {
-  termPutChar('$', ST77XX_RED);
-  termPutChar(' ', ST77XX_RED);
+void reapJobs() {
+  JobInfo j;
+  while (job_reap(j)) {
+    if (j.id == foreground) {
+      foreground = -1;
+      if (j.killed || j.failed) reportJob(j);
+      printShInit();
+    } else {
+      reportJob(j);
+    }
+  }
 }
 
-void runScriptTask(void* param) {
-  ScriptParam* sp = (ScriptParam*)param;
-  Lesp vm;
-
-  load_core_lib(&vm.global);
-  vm.global.loaded_libs->insert("core");
-
-  vm.run_script(sp->src);
-
-  Value mainFn;
-  if (vm.global.get("main", mainFn) && mainFn.type == V_LAMBDA) {
-    std::vector<Value> argValues;
-    for (auto& s : sp->args)
-      argValues.push_back(Value::String(s.c_str()));
+// `[-s stack] [-p priority] name [args...] [&]` starts /name.txt as a job,
+// in the background with a trailing `&`.
+void startJob(std::vector<String>& parts) {
+  JobSpec spec;
+  size_t i = 0;
+  for (; i + 1 < parts.size() && parts[i].startsWith("-"); i += 2) {
+    if (parts[i] == "-s") spec.stack = parts[i + 1].toInt();
+    else if (parts[i] == "-p") spec.priority = parts[i + 1].toInt();
+  }
+  bool background = parts.size() > i + 1 && parts.back() == "&";
+  if (background) parts.pop_back();
+  if (i >= parts.size()) {
+    printShInit();
+    return;
+  }
 
-    apply(mainFn, argValues, &vm.global);
+  spec.name = parts[i];
+  spec.path = "/" + spec.name + ".txt";
+  spec.args.assign(parts.begin() + i + 1, parts.end());
+  if (!SD.exists(spec.path)) {
+    shellPrint("File not found\n");
+    printShInit();
+    return;
   }
 
-  free(sp->src);
-  delete sp;
+  int id = job_start(spec);
+  if (id < 0) {
+    shellPrint("Too many jobs\n");
+    printShInit();
+  } else if (background) {
+    shellPrint("[" + String(id) + "] " + spec.name + "\n", ST77XX_YELLOW);
+    printShInit();
+  } else {
+    foreground = id;
+  }
+}
 
+void runCommand(std::vector<String>& parts) {
+  const String& cmd = parts[0];
+  if (cmd == "jobs") {
+    listJobs();
+  } else if ((cmd == "kill" || cmd == "wait") && parts.size() > 1) {
+    int id = job_find(parts[1]);
+    if (id < 0) {
+      shellPrint("No such job\n");
+    } else if (cmd == "kill") {
+      job_kill(id);
+    } else {
+      foreground = id;
+      return;
+    }
+  } else {
+    startJob(parts);
+    return;
+  }
   printShInit();
-  vTaskDelete(NULL);
 }
 
 void setup() {
@@ -130,6 +150,8 @@ void setup() {
   tft.setTextColor(ST77XX_WHITE);
   tft.setTextSize(1);
   termMutex = xSemaphoreCreateMutex();
+  term_start();
+  jobs_init();
   
   init_builtin_libs();
   
@@ -137,10 +159,14 @@ void setup() {
 }
 
 void loop() {
+  reapJobs();
+
   while (Serial.available()) {
     char c = Serial.read();
 
-    if (c == '\r' || c == '\n') {
+    if (c == 3) {
+      if (foreground >= 0) job_kill(foreground);
+    } else if (c == '\r' || c == '\n') {
       termPutChar('\n');
 
       if (inputBuffer.length()) {
@@ -148,45 +174,13 @@ void loop() {
         int start = 0;
         for (int i = 0; i <= inputBuffer.length(); i++) {
           if (i == inputBuffer.length() || inputBuffer[i] == ' ') {
-            parts.push_back(inputBuffer.substring(start, i));
+            if (i > start) parts.push_back(inputBuffer.substring(start, i));
             start = i + 1;
           }
         }
-
-        if (parts.empty()) return;
-
-        String fileName = parts[0];
-        std::vector<String> args(parts.begin() + 1, parts.end());
-        Serial.println(fileName);
-        String path = "/" + fileName + ".txt";
-        Serial.println(path);
-        File f = SD.open(path);
-        if (f) {
-          String src;
-          while (f.available()) {
-            char ch = f.read();
-            if (ch != '\r') src += ch;
-          }
-          f.close();
-
-          auto* sp = new ScriptParam;
-          sp->src = strdup(src.c_str());
-          sp->args = args;
-
-          xTaskCreatePinnedToCore(
-            runScriptTask,
-            "ScriptTask",
-            16000,
-            sp,
-            1,
-            NULL,
-            1);
-        } else {
-          b_println({ Value::String("File not found") }, nullptr);
-          printShInit();
-        }
-
         inputBuffer = "";
+
+        if (!parts.empty()) runCommand(parts);
       }
 
     } else if (c == 8 || c == 127) {
@@ -199,4 +193,4 @@ void loop() {
       termPutChar(c, 0x03E0);
     }
   }
-}
\ No newline at end of file
+}
@@ -0,0 +1,155 @@
+#include "jobs.h"
+#include "interpreter.h"
+#include "gc.h"
+
+struct Job {
+  int id = 0;
+  JobState state = JOB_FREE;
+  JobSpec spec;
+  Lesp* vm = nullptr;
+  bool killed = false;
+  bool failed = false;
+  unsigned long started = 0;
+  unsigned long elapsed = 0;
+  size_t peak = 0;
+};
+
+static Job jobs[MAX_JOBS];
+static int next_id = 1;
+static SemaphoreHandle_t jobMutex;
+
+static void lock() {
+  xSemaphoreTake(jobMutex, portMAX_DELAY);
+}
+
+static void unlock() {
+  xSemaphoreGive(jobMutex);
+}
+
+static JobInfo info(const Job& j) {
+  JobInfo i;
+  i.id = j.id;
+  i.name = j.spec.name;
+  i.state = j.state;
+  i.killed = j.killed;
+  i.failed = j.failed;
+  i.elapsed_ms = j.state == JOB_RUNNING ? millis() - j.started : j.elapsed;
+  i.peak = j.peak;
+  return i;
+}
+
+// The Lesp lives on the job's own stack. `vm` is published under the lock
+// so job_kill() never reaches one that is already gone.
+static void job_task(void* param) {
+  Job* job = (Job*)param;
+
+  {
+    File f = SD.open(job->spec.path);
+    Lesp vm(f ? f.size() : 0);
+
+    lock();
+    job->vm = &vm;
+    if (job->killed) vm.killed = true;
+    unlock();
+
+    if (f) vm.run_file(f, job->spec.path.c_str(), job->spec.args);
+    else vm.failed = true;
+
+    lock();
+    job->vm = nullptr;
+    job->failed = vm.failed;
+    job->peak = vm.heap->stats.peak;
+    unlock();
+  }
+
+  lock();
+  job->elapsed = millis() - job->started;
+  job->state = JOB_DONE;
+  unlock();
+  vTaskDelete(NULL);
+}
+
+void jobs_init() {
+  if (!jobMutex) jobMutex = xSemaphoreCreateMutex();
+}
+
+int job_start(const JobSpec& spec) {
+  lock();
+  Job* job = nullptr;
+  for (Job& j : jobs)
+    if (j.state == JOB_FREE) {
+      job = &j;
+      break;
+    }
+  if (!job) {
+    unlock();
+    return -1;
+  }
+  *job = Job();
+  job->id = next_id++;
+  job->spec = spec;
+  job->state = JOB_RUNNING;
+  job->started = millis();
+  int id = job->id;
+  unlock();
+
+  String task = "job:" + spec.name;
+  if (xTaskCreatePinnedToCore(job_task, task.c_str(), spec.stack, job, spec.priority, NULL, 1) != pdPASS) {
+    lock();
+    job->state = JOB_FREE;
+    unlock();
+    return -1;
+  }
+  return id;
+}
+
+int job_find(const String& ref) {
+  int want = ref.toInt();
+  int found = -1;
+  lock();
+  for (const Job& j : jobs) {
+    if (j.state == JOB_FREE) continue;
+    if (want > 0 ? j.id == want : j.spec.name == ref) {
+      if (j.id > found) found = j.id;
+    }
+  }
+  unlock();
+  return found;
+}
+
+bool job_kill(int id) {
+  bool found = false;
+  lock();
+  for (Job& j : jobs) {
+    if (j.state != JOB_RUNNING || j.id != id) continue;
+    j.killed = true;
+    if (j.vm) j.vm->killed = true;
+    found = true;
+  }
+  unlock();
+  return found;
+}
+
+std::vector<JobInfo> job_list() {
+  std::vector<JobInfo> out;
+  lock();
+  for (const Job& j : jobs)
+    if (j.state != JOB_FREE) out.push_back(info(j));
+  unlock();
+  return out;
+}
+
+bool job_reap(JobInfo& out) {
+  bool found = false;
+  lock();
+  for (Job& j : jobs) {
+    if (j.state != JOB_DONE) continue;
+    out = info(j);
+    j.state = JOB_FREE;
+    j.spec = JobSpec();
+    found = true;
+    break;
+  }
+  unlock();
+  return found;
+}
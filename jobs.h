@@ -0,0 +1,60 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <Arduino.h>
+#include <vector>
+
+// Scripts started from the shell run as jobs, each on its own task with its
+// own Lesp. At most MAX_JOBS run at once.
+constexpr size_t MAX_JOBS = 8;
+constexpr uint32_t JOB_STACK = 16000;
+constexpr UBaseType_t JOB_PRIORITY = 1;
+
+enum JobState : uint8_t {
+  JOB_FREE,
+  JOB_RUNNING,
+  JOB_DONE
+};
+
+struct JobSpec {
+  String name;
+  String path;
+  std::vector<String> args;
+  uint32_t stack = JOB_STACK;
+  UBaseType_t priority = JOB_PRIORITY;
+};
+
+// One entry of the job table as it was when it was read. `elapsed_ms` is the
+// running time so far, or in total once the job is done; `peak` is the
+// script's peak heap, known once it is done.
+struct JobInfo {
+  int id;
+  String name;
+  JobState state;
+  bool killed;
+  bool failed;
+  unsigned long elapsed_ms;
+  size_t peak;
+};
+
+void jobs_init();
+
+// Starts a job and returns its id, or -1 if the table is full or the task
+// could not be created.
+int job_start(const JobSpec& spec);
+
+// Resolves a job by id or by name (the most recent job of that name still
+// in the table); -1 if there is none.
+int job_find(const String& ref);
+
+// Asks a job to stop. The script halts at its next jump, call or blocking
+// builtin, and its heap is freed as usual.
+bool job_kill(int id);
+
+std::vector<JobInfo> job_list();
+
+// Takes the next finished job off the table. Returns false if none has
+// finished since the last call.
+bool job_reap(JobInfo& out);
+
+#endif
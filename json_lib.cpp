@@ -0,0 +1,490 @@
+#include "json_lib.h"
+#include "gc.h"
+#include "source.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Pulls JSON text a block at a time from a SourceReader, or walks a string
+// in place, so a document is never held whole. Every value is either built
+// (`out` set) or skipped (`out` null); skipping allocates nothing.
+//
+// Arrays become lists and objects maps; true and false become 1 and 0,
+// null nil, and numbers ints when they fit and floats otherwise.
+struct JsonReader {
+  SourceReader* src = nullptr;
+  const char* p;
+  const char* end;
+  int depth = 0;
+  char block[SOURCE_BLOCK];
+
+  explicit JsonReader(const std::string& text) : p(text.data()), end(text.data() + text.size()) {}
+  explicit JsonReader(SourceReader* s) : src(s), p(block), end(block) {}
+
+  int peek() {
+    if (p == end && !refill()) return -1;
+    return (unsigned char)*p;
+  }
+
+  int skip_ws() {
+    int c;
+    while ((c = peek()) == ' ' || c == '\n' || c == '\r' || c == '\t') p++;
+    return c;
+  }
+
+  bool value(Value* out) {
+    switch (skip_ws()) {
+    case '{':
+      return object(out);
+    case '[':
+      return array(out);
+    case '"':
+      if (!out) return string([](const char*, size_t) { return true; });
+      {
+        std::string s;
+        if (!string([&s](const char* b, size_t n) {
+              s.append(b, n);
+              return true;
+            }))
+          return false;
+        *out = Value::String(std::move(s));
+      }
+      return true;
+    case 't':
+      if (out) *out = Value::Int(1);
+      return word("true");
+    case 'f':
+      if (out) *out = Value::Int(0);
+      return word("false");
+    case 'n':
+      if (out) *out = Value::Nil();
+      return word("null");
+    default:
+      return number(out);
+    }
+  }
+
+  // Reads a string, handing its decoded bytes to `put` a run at a time.
+  // Stops early, returning false, if `put` does.
+  template <typename F>
+  bool string(F put) {
+    p++;
+    for (;;) {
+      if (peek() < 0) return false;
+      const char* run = p;
+      while (p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) p++;
+      if (p > run && !put(run, p - run)) return false;
+      if (p == end) continue;
+      char c = *p++;
+      if (c == '"') return true;
+      if (c != '\\') return false;
+
+      int e = peek();
+      if (e < 0) return false;
+      p++;
+      char utf8[4];
+      size_t n = 1;
+      switch (e) {
+      case '"': utf8[0] = '"'; break;
+      case '\\': utf8[0] = '\\'; break;
+      case '/': utf8[0] = '/'; break;
+      case 'b': utf8[0] = '\b'; break;
+      case 'f': utf8[0] = '\f'; break;
+      case 'n': utf8[0] = '\n'; break;
+      case 'r': utf8[0] = '\r'; break;
+      case 't': utf8[0] = '\t'; break;
+      case 'u': {
+        long cp = hex4();
+        if (cp >= 0xD800 && cp < 0xDC00 && peek() == '\\') {
+          p++;
+          if (peek() != 'u') return false;
+          p++;
+          long lo = hex4();
+          if (lo < 0xDC00 || lo >= 0xE000) return false;
+          cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+        }
+        if (cp < 0) return false;
+        n = encode_utf8(cp, utf8);
+        break;
+      }
+      default:
+        return false;
+      }
+      if (!put(utf8, n)) return false;
+    }
+  }
+
+  // Consumes an object key and says whether it is `want`, without copying
+  // it.
+  bool key_is(const std::string& want, bool& match) {
+    size_t at = 0;
+    match = true;
+    bool ok = string([&](const char* b, size_t n) {
+      if (match && (at + n > want.size() || memcmp(want.data() + at, b, n) != 0)) match = false;
+      at += n;
+      return true;
+    });
+    match = match && at == want.size();
+    return ok;
+  }
+
+  // Moves past the ',' between members or elements; false at `close`,
+  // which is consumed too.
+  bool more(char close, bool& ok) {
+    int c = skip_ws();
+    if (c >= 0) p++;
+    if (c == ',') return true;
+    ok = c == close;
+    return false;
+  }
+
+  bool array(Value* out) {
+    if (++depth > JSON_MAX_DEPTH) return false;
+    p++;
+    ValueList items;
+    bool ok = true;
+    if (skip_ws() == ']') {
+      p++;
+    } else {
+      do {
+        Value v;
+        if (!value(out ? &v : nullptr)) return false;
+        if (out) items.push_back(v);
+      } while (more(']', ok));
+    }
+    if (out && ok) *out = Value::List(std::move(items));
+    depth--;
+    return ok;
+  }
+
+  bool object(Value* out) {
+    if (++depth > JSON_MAX_DEPTH) return false;
+    p++;
+    Value members;
+    if (out) members = Value::Map();
+    bool ok = true;
+    if (skip_ws() == '}') {
+      p++;
+    } else {
+      do {
+        Value key, v;
+        if (!member_key(out ? &key : nullptr) || !value(out ? &v : nullptr)) return false;
+        if (out) {
+          members.map().set(key, v);
+          if (Heap* heap = current_heap()) heap->resized(&members.map());
+        }
+      } while (more('}', ok));
+    }
+    if (out && ok) *out = members;
+    depth--;
+    return ok;
+  }
+
+  // The key of an object member and the ':' after it.
+  bool member_key(Value* out) {
+    if (skip_ws() != '"') return false;
+    Value key;
+    if (!value(out ? &key : nullptr)) return false;
+    if (out) *out = key;
+    return colon();
+  }
+
+  bool colon() {
+    if (skip_ws() != ':') return false;
+    p++;
+    return true;
+  }
+
+  bool number(Value* out) {
+    char buf[32];
+    size_t n = 0;
+    bool integral = true;
+    int c;
+    while ((c = peek()) >= 0 && (isdigit(c) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E')) {
+      if (n == sizeof(buf) - 1) return false;
+      if (c == '.' || c == 'e' || c == 'E') integral = false;
+      buf[n++] = (char)c;
+      p++;
+    }
+    if (!n) return false;
+    buf[n] = 0;
+    char* stop;
+    if (integral) {
+      long long v = strtoll(buf, &stop, 10);
+      if (*stop) return false;
+      if (out) *out = v >= INT32_MIN && v <= INT32_MAX ? Value::Int((int)v) : Value::Float((double)v);
+    } else {
+      double v = strtod(buf, &stop);
+      if (*stop) return false;
+      if (out) *out = Value::Float(v);
+    }
+    return true;
+  }
+
+private:
+  bool refill() {
+    if (!src) return false;
+    size_t n = src->read(block, sizeof(block));
+    p = block;
+    end = block + n;
+    return n > 0;
+  }
+
+  bool word(const char* w) {
+    for (; *w; w++, p++)
+      if (peek() != *w) return false;
+    return true;
+  }
+
+  long hex4() {
+    long v = 0;
+    for (int i = 0; i < 4; i++, p++) {
+      int c = peek();
+      if (!isxdigit(c)) return -1;
+      v = v * 16 + (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10));
+    }
+    return v;
+  }
+
+  static size_t encode_utf8(long cp, char* out) {
+    if (cp < 0x80) {
+      out[0] = (char)cp;
+      return 1;
+    }
+    if (cp < 0x800) {
+      out[0] = (char)(0xC0 | (cp >> 6));
+      out[1] = (char)(0x80 | (cp & 0x3F));
+      return 2;
+    }
+    if (cp < 0x10000) {
+      out[0] = (char)(0xE0 | (cp >> 12));
+      out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+      out[2] = (char)(0x80 | (cp & 0x3F));
+      return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+  }
+};
+
+// Feeds a JsonReader from any handle with a byte stream: an HTTP body, a
+// file opened for reading.
+struct HandleReader : SourceReader {
+  HandleObj* h;
+
+  explicit HandleReader(HandleObj* handle) : h(handle) {}
+  size_t read(char* buf, size_t n) override {
+    return h->read_bytes(buf, n);
+  }
+};
+
+// One step of a json.select path: a member name, or an index for "[n]".
+struct JsonStep {
+  std::string key;
+  int index;
+};
+
+// "a.b[3]" -> a, b, [3]. False if the path is malformed.
+static bool parse_path(const std::string& path, std::vector<JsonStep>& steps) {
+  size_t i = 0;
+  while (i < path.size()) {
+    if (path[i] == '[') {
+      char* stop;
+      long n = strtol(path.c_str() + i + 1, &stop, 10);
+      if (*stop != ']' || n < 0) return false;
+      steps.push_back(JsonStep{ std::string(), (int)n });
+      i = stop - path.c_str() + 1;
+    } else {
+      if (path[i] == '.') i++;
+      size_t e = path.find_first_of(".[", i);
+      if (e == std::string::npos) e = path.size();
+      if (e == i) return false;
+      steps.push_back(JsonStep{ path.substr(i, e - i), -1 });
+      i = e;
+    }
+  }
+  return true;
+}
+
+// Walks down `steps`, skipping every sibling on the way, and builds only
+// the value at the end. `out` stays nil if the path is not there.
+static bool select_path(JsonReader& r, const std::vector<JsonStep>& steps, size_t at, Value& out) {
+  if (at == steps.size()) return r.value(&out);
+  const JsonStep& step = steps[at];
+  int c = r.skip_ws();
+  bool ok = true;
+
+  if (step.index >= 0) {
+    if (c != '[') return r.value(nullptr);
+    r.p++;
+    if (r.skip_ws() == ']') {
+      r.p++;
+      return true;
+    }
+    int i = 0;
+    do {
+      if (i++ == step.index) return select_path(r, steps, at + 1, out);
+      if (!r.value(nullptr)) return false;
+    } while (r.more(']', ok));
+    return ok;
+  }
+
+  if (c != '{') return r.value(nullptr);
+  r.p++;
+  if (r.skip_ws() == '}') {
+    r.p++;
+    return true;
+  }
+  do {
+    bool match;
+    if (r.skip_ws() != '"' || !r.key_is(step.key, match) || !r.colon()) return false;
+    if (match) return select_path(r, steps, at + 1, out);
+    if (!r.value(nullptr)) return false;
+  } while (r.more('}', ok));
+  return ok;
+}
+
+static void write_string(const std::string& s, std::string& out) {
+  out += '"';
+  size_t run = 0;
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    if (c >= 0x20 && c != '"' && c != '\\') continue;
+    out.append(s, run, i - run);
+    run = i + 1;
+    switch (c) {
+    case '"': out += "\\\""; break;
+    case '\\': out += "\\\\"; break;
+    case '\n': out += "\\n"; break;
+    case '\r': out += "\\r"; break;
+    case '\t': out += "\\t"; break;
+    default: {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      out += esc;
+    }
+    }
+  }
+  out.append(s, run, std::string::npos);
+  out += '"';
+}
+
+// False if the value nests deeper than JSON_MAX_DEPTH, as a list that
+// contains itself does.
+static bool write_json(const Value& v, std::string& out, int depth) {
+  char num[32];
+  switch (v.type) {
+  case V_INT:
+    out.append(num, snprintf(num, sizeof(num), "%d", v.i));
+    return true;
+  case V_FLOAT:
+    if (!std::isfinite(v.f)) {
+      out += "null";
+    } else {
+      int n = snprintf(num, sizeof(num), "%.15g", v.f);
+      if (strtod(num, nullptr) != v.f) n = snprintf(num, sizeof(num), "%.17g", v.f);
+      out.append(num, n);
+    }
+    return true;
+  case V_STRING:
+    write_string(v.str(), out);
+    return true;
+  case V_LIST: {
+    if (depth >= JSON_MAX_DEPTH) return false;
+    const ValueList& items = v.list();
+    out += '[';
+    for (size_t i = 0; i < items.size(); i++) {
+      if (i) out += ',';
+      if (!write_json(items[i], out, depth + 1)) return false;
+    }
+    out += ']';
+    return true;
+  }
+  case V_MAP: {
+    if (depth >= JSON_MAX_DEPTH) return false;
+    bool first = true;
+    out += '{';
+    for (auto& e : v.map().entries) {
+      if (!e.hash) continue;
+      if (!first) out += ',';
+      first = false;
+      // JSON keys are strings: any other key is written as its JSON text.
+      if (e.key.type == V_STRING) {
+        write_string(e.key.str(), out);
+      } else {
+        std::string key;
+        if (!write_json(e.key, key, depth + 1)) return false;
+        write_string(key, out);
+      }
+      out += ':';
+      if (!write_json(e.val, out, depth + 1)) return false;
+    }
+    out += '}';
+    return true;
+  }
+  default:
+    out += "null";
+    return true;
+  }
+}
+
+static HandleObj* stream_arg(const Value& v) {
+  return v.type == V_HANDLE ? static_cast<HandleObj*>(v.obj) : nullptr;
+}
+
+// (json.parse src) builds the value in `src`: a string, or a handle to
+// read it from, such as one from http.open or fs.open. nil if it is not
+// well-formed.
+Value b_json_parse(const std::vector<Value>& args, Env*) {
+  if (args.empty()) return Value::Nil();
+  Value out;
+  if (args[0].type == V_STRING) {
+    JsonReader r(args[0].str());
+    if (!r.value(&out) || r.skip_ws() >= 0) return Value::Nil();
+    return out;
+  }
+  HandleObj* h = stream_arg(args[0]);
+  if (!h) return Value::Nil();
+  HandleReader src(h);
+  JsonReader r(&src);
+  return r.value(&out) ? out : Value::Nil();
+}
+
+// (json.select src path) is the value at `path`, such as "a.b[3]", in a
+// string or handle as for json.parse, or nil if there is none. Only that
+// value is built; everything before it is skipped and nothing after it is
+// read.
+Value b_json_select(const std::vector<Value>& args, Env*) {
+  if (args.size() < 2 || args[1].type != V_STRING) return Value::Nil();
+  std::vector<JsonStep> steps;
+  if (!parse_path(args[1].str(), steps)) return Value::Nil();
+  Value out;
+  if (args[0].type == V_STRING) {
+    JsonReader r(args[0].str());
+    return select_path(r, steps, 0, out) ? out : Value::Nil();
+  }
+  HandleObj* h = stream_arg(args[0]);
+  if (!h) return Value::Nil();
+  HandleReader src(h);
+  JsonReader r(&src);
+  return select_path(r, steps, 0, out) ? out : Value::Nil();
+}
+
+// (json.stringify v) is v as JSON text, maps written as objects. nil if v
+// nests too deeply.
+Value b_json_stringify(const std::vector<Value>& args, Env*) {
+  if (args.empty()) return Value::String("null");
+  std::string out;
+  if (!write_json(args[0], out, 0)) return Value::Nil();
+  return Value::String(std::move(out));
+}
+
+void load_json_lib(Env* env) {
+  env->define("parse", Value::Func(b_json_parse));
+  env->define("select", Value::Func(b_json_select));
+  env->define("stringify", Value::Func(b_json_stringify));
+}
@@ -0,0 +1,12 @@
+#ifndef JSON_LIB_H
+#define JSON_LIB_H
+
+#include "interpreter.h"
+
+// Deepest nesting of arrays and objects json will parse or write. Both
+// recurse, and a script task's stack is small.
+constexpr int JSON_MAX_DEPTH = 32;
+
+void load_json_lib(Env* env);
+
+#endif
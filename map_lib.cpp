@@ -0,0 +1,229 @@
+#include "map_lib.h"
+#include "vm.h"
+#include "gc.h"
+#include <cstring>
+
+static const int32_t EMPTY = -1;
+static const int32_t REMOVED = -2;
+
+static uint32_t mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return (uint32_t)x;
+}
+
+static uint32_t hash_bytes(const std::string& s) {
+  uint32_t h = 2166136261u;
+  for (unsigned char c : s) h = (h ^ c) * 16777619u;
+  return h;
+}
+
+// Never 0, which marks a removed entry.
+static uint32_t key_hash(const Value& k) {
+  uint32_t h;
+  switch (k.type) {
+    case V_INT: h = mix((uint32_t)k.i); break;
+    case V_FLOAT: {
+      double f = k.f == 0 ? 0.0 : k.f;
+      uint64_t bits;
+      memcpy(&bits, &f, sizeof(bits));
+      h = mix(bits);
+      break;
+    }
+    case V_STRING: {
+      StringObj* s = static_cast<StringObj*>(k.obj);
+      if (s->hash) return s->hash;
+      h = hash_bytes(s->str);
+      if (!h) h = 1;
+      if (!s->builder) s->hash = h;
+      return h;
+    }
+    case V_SYMBOL: h = mix(k.sym); break;
+    default: h = mix((uintptr_t)k.obj ^ ((uint64_t)k.type << 56)); break;
+  }
+  return h ? h : 1;
+}
+
+static bool key_eq(const Value& a, const Value& b) {
+  if (a.type != b.type) return false;
+  switch (a.type) {
+    case V_INT: return a.i == b.i;
+    case V_FLOAT: return a.f == b.f;
+    case V_STRING: return a.obj == b.obj || a.str() == b.str();
+    case V_SYMBOL: return a.sym == b.sym;
+    case V_NIL: return true;
+    default: return a.obj == b.obj;
+  }
+}
+
+// Index slot holding `key`, or EMPTY. `at` is the slot to insert it in if
+// it is missing: the first removed slot on its probe path, or the empty one
+// that ended the search.
+int32_t MapObj::slot(const Value& key, uint32_t hash, size_t& at) {
+  size_t mask = index.size() - 1;
+  size_t i = hash & mask;
+  size_t reuse = SIZE_MAX;
+  for (;;) {
+    int32_t e = index[i];
+    if (e == EMPTY) {
+      at = reuse != SIZE_MAX ? reuse : i;
+      return EMPTY;
+    }
+    if (e == REMOVED) {
+      if (reuse == SIZE_MAX) reuse = i;
+    } else if (entries[e].hash == hash && key_eq(entries[e].key, key)) {
+      at = i;
+      return e;
+    }
+    i = (i + 1) & mask;
+  }
+}
+
+Value* MapObj::find(const Value& key) {
+  if (!count) return nullptr;
+  size_t at;
+  int32_t e = slot(key, key_hash(key), at);
+  return e == EMPTY ? nullptr : &entries[e].val;
+}
+
+void MapObj::set(const Value& key, const Value& val) {
+  uint32_t hash = key_hash(key);
+  size_t at;
+  if (!index.empty()) {
+    int32_t e = slot(key, hash, at);
+    if (e != EMPTY) {
+      entries[e].val = val;
+      return;
+    }
+  }
+  if ((entries.size() + 1) * 4 > index.size() * 3) {
+    size_t size = MAP_MIN_INDEX;
+    while ((count + 1) * 4 > size * 3 / 2) size *= 2;
+    rebuild(size);
+    slot(key, hash, at);
+  }
+  index[at] = (int32_t)entries.size();
+  entries.push_back(Entry{ key, val, hash });
+  count++;
+}
+
+bool MapObj::remove(const Value& key) {
+  if (!count) return false;
+  size_t at;
+  int32_t e = slot(key, key_hash(key), at);
+  if (e == EMPTY) return false;
+  index[at] = REMOVED;
+  entries[e] = Entry{ Value::Nil(), Value::Nil(), 0 };
+  count--;
+  return true;
+}
+
+// Drops removed entries and re-indexes the rest in a table of `size`
+// slots from their stored hashes.
+void MapObj::rebuild(size_t size) {
+  size_t n = 0;
+  for (size_t i = 0; i < entries.size(); i++)
+    if (entries[i].hash) entries[n++] = entries[i];
+  entries.resize(n);
+  index.assign(size, EMPTY);
+  for (size_t i = 0; i < n; i++) {
+    size_t j = entries[i].hash & (size - 1);
+    while (index[j] != EMPTY) j = (j + 1) & (size - 1);
+    index[j] = (int32_t)i;
+  }
+}
+
+static void mutated(MapObj* m) {
+  if (Heap* heap = current_heap()) {
+    heap->barrier(m);
+    heap->resized(m);
+  }
+}
+
+static MapObj* map_arg(const std::vector<Value>& args) {
+  return !args.empty() && args[0].type == V_MAP ? &args[0].map() : nullptr;
+}
+
+// (map k1 v1 k2 v2 ...) makes a map of the given pairs.
+Value b_map(const std::vector<Value>& args, Env*) {
+  Value m = Value::Map();
+  for (size_t i = 0; i + 1 < args.size(); i += 2) m.map().set(args[i], args[i + 1]);
+  return m;
+}
+
+// (map-get m key [default])
+Value b_map_get(const std::vector<Value>& args, Env*) {
+  MapObj* m = map_arg(args);
+  Value* v = m && args.size() > 1 ? m->find(args[1]) : nullptr;
+  if (v) return *v;
+  return args.size() > 2 ? args[2] : Value::Nil();
+}
+
+// (map-set! m key value) stores in place and returns m.
+Value b_map_set(const std::vector<Value>& args, Env*) {
+  MapObj* m = map_arg(args);
+  if (!m || args.size() < 3) return Value::Nil();
+  m->set(args[1], args[2]);
+  mutated(m);
+  return args[0];
+}
+
+Value b_map_has(const std::vector<Value>& args, Env*) {
+  MapObj* m = map_arg(args);
+  return Value::Int(m && args.size() > 1 && m->find(args[1]));
+}
+
+// (map-del! m key) is 1 if key was there.
+Value b_map_del(const std::vector<Value>& args, Env*) {
+  MapObj* m = map_arg(args);
+  return Value::Int(m && args.size() > 1 && m->remove(args[1]));
+}
+
+static Value column(const std::vector<Value>& args, bool keys) {
+  MapObj* m = map_arg(args);
+  ValueList out;
+  if (!m) return Value::List(std::move(out));
+  out.reserve(m->count);
+  for (auto& e : m->entries)
+    if (e.hash) out.push_back(keys ? e.key : e.val);
+  return Value::List(std::move(out));
+}
+
+Value b_map_keys(const std::vector<Value>& args, Env*) {
+  return column(args, true);
+}
+
+Value b_map_values(const std::vector<Value>& args, Env*) {
+  return column(args, false);
+}
+
+// (map-each m f) calls (f key value) for each entry in insertion order and
+// returns how many it visited. f may change the map; whether entries it
+// adds or removes are visited is unspecified.
+Value b_map_each(const std::vector<Value>& args, Env* env) {
+  MapObj* m = map_arg(args);
+  if (!m || args.size() < 2) return Value::Int(0);
+  Value fn = args[1];
+  std::vector<Value> kv(2);
+  int n = 0;
+  for (size_t i = 0; i < m->entries.size() && !Lesp::current->halted; i++) {
+    if (!m->entries[i].hash) continue;
+    kv[0] = m->entries[i].key;
+    kv[1] = m->entries[i].val;
+    apply(fn, kv, env);
+    n++;
+  }
+  return Value::Int(n);
+}
+
+void load_map_lib(Env* env) {
+  env->define("map", Value::Func(b_map));
+  env->define("map-get", Value::Func(b_map_get));
+  env->define("map-set!", Value::Func(b_map_set));
+  env->define("map-has", Value::Func(b_map_has));
+  env->define("map-del!", Value::Func(b_map_del));
+  env->define("map-keys", Value::Func(b_map_keys));
+  env->define("map-values", Value::Func(b_map_values));
+  env->define("map-each", Value::Func(b_map_each));
+}
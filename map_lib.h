@@ -0,0 +1,12 @@
+#ifndef MAP_LIB_H
+#define MAP_LIB_H
+
+#include "interpreter.h"
+
+// Slots in a map's index when it gets its first key. The index doubles
+// whenever it would be more than 3/4 full.
+constexpr size_t MAP_MIN_INDEX = 8;
+
+void load_map_lib(Env* env);
+
+#endif
@@ -1,5 +1,19 @@
 #include "math_lib.h"
+#include "gc.h"
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// On the device, float kernels go to esp-dsp when it is there: its
+// routines use the ESP32's zero-overhead loops, and the S3's PIE vector
+// unit.
+#if defined(ESP_PLATFORM) && defined(__has_include)
+#if __has_include(<esp_dsp.h>)
+#include <esp_dsp.h>
+#define LESP_ESP_DSP 1
+#endif
+#endif
 
 Value b_abs(const std::vector<Value>& a, Env*) {
   if (a.empty()) return Value::Int(0);
@@ -27,67 +41,549 @@ Value b_sqrt(const std::vector<Value>& a, Env*) {
 
 Value b_pow(const std::vector<Value>& args, Env*) {
   if (args.size() < 2) return Value::Float(0.0);
-  double base = (args[0].type == V_INT) ? args[0].i : args[0].f;
-  double exp = (args[1].type == V_INT) ? args[1].i : args[1].f;
+  double base = args[0].num();
+  double exp = args[1].num();
   return Value::Float(pow(base, exp));
 }
 
-Value b_min(const std::vector<Value>& args, Env*) {
-  if (args.empty()) return Value::Nil();
-  double minVal = (args[0].type == V_INT) ? args[0].i : args[0].f;
-  for (size_t i = 1; i < args.size(); i++) {
-    double val = (args[i].type == V_INT) ? args[i].i : args[i].f;
-    if (val < minVal) minVal = val;
-  }
-  return Value::Float(minVal);
-}
-
-Value b_max(const std::vector<Value>& args, Env*) {
-  if (args.empty()) return Value::Nil();
-  double maxVal = (args[0].type == V_INT) ? args[0].i : args[0].f;
-  for (size_t i = 1; i < args.size(); i++) {
-    double val = (args[i].type == V_INT) ? args[i].i : args[i].f;
-    if (val > maxVal) maxVal = val;
-  }
-  return Value::Float(maxVal);
-}
-
 Value b_sin(const std::vector<Value>& args, Env*) {
   if (args.empty()) return Value::Float(0.0);
-  double val = (args[0].type == V_INT) ? args[0].i : args[0].f;
+  double val = args[0].num();
   return Value::Float(sin(val));
 }
 
 Value b_cos(const std::vector<Value>& args, Env*) {
   if (args.empty()) return Value::Float(0.0);
-  double val = (args[0].type == V_INT) ? args[0].i : args[0].f;
+  double val = args[0].num();
   return Value::Float(cos(val));
 }
 
 Value b_tan(const std::vector<Value>& args, Env*) {
   if (args.empty()) return Value::Float(0.0);
-  double val = (args[0].type == V_INT) ? args[0].i : args[0].f;
+  double val = args[0].num();
   return Value::Float(tan(val));
 }
 
 Value b_asin(const std::vector<Value>& args, Env*) {
   if (args.empty()) return Value::Float(0.0);
-  double val = (args[0].type == V_INT) ? args[0].i : args[0].f;
+  double val = args[0].num();
   return Value::Float(asin(val));
 }
 
 Value b_acos(const std::vector<Value>& args, Env*) {
   if (args.empty()) return Value::Float(0.0);
-  double val = (args[0].type == V_INT) ? args[0].i : args[0].f;
+  double val = args[0].num();
   return Value::Float(acos(val));
 }
 
 Value b_atan(const std::vector<Value>& args, Env*) {
   if (args.empty()) return Value::Float(0.0);
-  double val = (args[0].type == V_INT) ? args[0].i : args[0].f;
+  double val = args[0].num();
   return Value::Float(atan(val));
 }
 
+static const char F32_HANDLE[] = "f32";
+static const char I32_HANDLE[] = "i32";
+
+// A packed array of 32-bit floats or ints: 4 bytes an element instead of a
+// 16-byte Value, laid out for the kernels below.
+template <typename T>
+struct NumArray : HandleObj {
+  std::vector<T> v;
+
+  NumArray(const char* kind, size_t n) : HandleObj(kind), v(n) {}
+  size_t footprint() const override {
+    return sizeof(NumArray) + v.capacity() * sizeof(T);
+  }
+};
+
+using F32Array = NumArray<float>;
+using I32Array = NumArray<int32_t>;
+
+template <typename T>
+static const char* kind_of();
+template <>
+const char* kind_of<float>() {
+  return F32_HANDLE;
+}
+template <>
+const char* kind_of<int32_t>() {
+  return I32_HANDLE;
+}
+
+static HandleObj* array_arg(const std::vector<Value>& args, size_t i) {
+  if (args.size() <= i || args[i].type != V_HANDLE) return nullptr;
+  HandleObj* h = static_cast<HandleObj*>(args[i].obj);
+  return h->kind == F32_HANDLE || h->kind == I32_HANDLE ? h : nullptr;
+}
+
+static bool is_f32(HandleObj* h) {
+  return h->kind == F32_HANDLE;
+}
+
+static F32Array* f32(HandleObj* h) {
+  return static_cast<F32Array*>(h);
+}
+
+static I32Array* i32(HandleObj* h) {
+  return static_cast<I32Array*>(h);
+}
+
+static size_t array_size(HandleObj* h) {
+  return is_f32(h) ? f32(h)->v.size() : i32(h)->v.size();
+}
+
+template <typename T>
+static NumArray<T>* make_array(size_t n) {
+  return Lesp::current->heap->make<NumArray<T>>(kind_of<T>(), n);
+}
+
+// Where a result of `n` elements goes: the array passed as args[i] if it
+// holds T, resized to fit, else a new one.
+template <typename T>
+static NumArray<T>* result(const std::vector<Value>& args, size_t i, size_t n) {
+  HandleObj* h = array_arg(args, i);
+  if (!h || h->kind != kind_of<T>()) return make_array<T>(n);
+  NumArray<T>* out = static_cast<NumArray<T>*>(h);
+  if (out->v.size() != n) {
+    out->v.resize(n);
+    Lesp::current->heap->resized(out);
+  }
+  return out;
+}
+
+// The elements of an array as floats, converted into `tmp` if they are
+// ints. Lets a float kernel take an int array alongside a float one.
+static const float* as_f32(HandleObj* h, std::vector<float>& tmp) {
+  if (is_f32(h)) return f32(h)->v.data();
+  const std::vector<int32_t>& v = i32(h)->v;
+  tmp.assign(v.begin(), v.end());
+  return tmp.data();
+}
+
+static bool fits_i32(double x) {
+  return x >= INT32_MIN && x <= INT32_MAX;
+}
+
+static Value number(double x) {
+  return fits_i32(x) && x == (int32_t)x ? Value::Int((int32_t)x) : Value::Float(x);
+}
+
+// A number as an element of T. Ints saturate, and NaN is 0.
+template <typename T>
+static T element(double x);
+template <>
+float element<float>(double x) {
+  return (float)x;
+}
+template <>
+int32_t element<int32_t>(double x) {
+  if (fits_i32(x)) return (int32_t)x;
+  return x > 0 ? INT32_MAX : x < 0 ? INT32_MIN : 0;
+}
+
+// The kernels. Each runs MATH_LANES independent lanes over whole blocks
+// and finishes the tail one element at a time; the fixed-length inner
+// loops are what the vectorizer packs into SIMD instructions. Int
+// arithmetic wraps as on the hardware instead of being undefined.
+
+template <typename T, typename Acc>
+static Acc k_sum(const T* a, size_t n) {
+  Acc lane[MATH_LANES] = {};
+  size_t i = 0;
+  for (; i + MATH_LANES <= n; i += MATH_LANES)
+    for (size_t j = 0; j < MATH_LANES; j++) lane[j] += a[i + j];
+  Acc s = 0;
+  for (size_t j = 0; j < MATH_LANES; j++) s += lane[j];
+  for (; i < n; i++) s += a[i];
+  return s;
+}
+
+template <typename T, typename Acc>
+static Acc k_dot(const T* a, const T* b, size_t n) {
+  Acc lane[MATH_LANES] = {};
+  size_t i = 0;
+  for (; i + MATH_LANES <= n; i += MATH_LANES)
+    for (size_t j = 0; j < MATH_LANES; j++) lane[j] += (Acc)a[i + j] * b[i + j];
+  Acc s = 0;
+  for (size_t j = 0; j < MATH_LANES; j++) s += lane[j];
+  for (; i < n; i++) s += (Acc)a[i] * b[i];
+  return s;
+}
+
+static float dot_f32(const float* a, const float* b, size_t n) {
+#ifdef LESP_ESP_DSP
+  float r = 0;
+  dsps_dotprod_f32(a, b, &r, (int)n);
+  return r;
+#else
+  return k_dot<float, float>(a, b, n);
+#endif
+}
+
+static inline float add_wrap(float x, float y) {
+  return x + y;
+}
+
+static inline int32_t add_wrap(int32_t x, int32_t y) {
+  return (int32_t)((uint32_t)x + (uint32_t)y);
+}
+
+static inline float mul_wrap(float x, float y) {
+  return x * y;
+}
+
+static inline int32_t mul_wrap(int32_t x, int32_t y) {
+  return (int32_t)((uint32_t)x * (uint32_t)y);
+}
+
+// out may be a or b: each block is read in full before it is written.
+template <typename T>
+static void k_add(const T* a, const T* b, T* out, size_t n) {
+  size_t i = 0;
+  for (; i + MATH_LANES <= n; i += MATH_LANES) {
+    T t[MATH_LANES];
+    for (size_t j = 0; j < MATH_LANES; j++) t[j] = add_wrap(a[i + j], b[i + j]);
+    for (size_t j = 0; j < MATH_LANES; j++) out[i + j] = t[j];
+  }
+  for (; i < n; i++) out[i] = add_wrap(a[i], b[i]);
+}
+
+template <typename T>
+static void k_add_scalar(const T* a, T k, T* out, size_t n) {
+  size_t i = 0;
+  for (; i + MATH_LANES <= n; i += MATH_LANES) {
+    T t[MATH_LANES];
+    for (size_t j = 0; j < MATH_LANES; j++) t[j] = add_wrap(a[i + j], k);
+    for (size_t j = 0; j < MATH_LANES; j++) out[i + j] = t[j];
+  }
+  for (; i < n; i++) out[i] = add_wrap(a[i], k);
+}
+
+template <typename T>
+static void k_scale(const T* a, T k, T* out, size_t n) {
+  size_t i = 0;
+  for (; i + MATH_LANES <= n; i += MATH_LANES) {
+    T t[MATH_LANES];
+    for (size_t j = 0; j < MATH_LANES; j++) t[j] = mul_wrap(a[i + j], k);
+    for (size_t j = 0; j < MATH_LANES; j++) out[i + j] = t[j];
+  }
+  for (; i < n; i++) out[i] = mul_wrap(a[i], k);
+}
+
+static void add_f32(const float* a, const float* b, float* out, size_t n) {
+#ifdef LESP_ESP_DSP
+  dsps_add_f32(a, b, out, (int)n, 1, 1, 1);
+#else
+  k_add(a, b, out, n);
+#endif
+}
+
+static void scale_f32(const float* a, float k, float* out, size_t n) {
+#ifdef LESP_ESP_DSP
+  dsps_mulc_f32(a, out, (int)n, k, 1, 1);
+#else
+  k_scale(a, k, out, n);
+#endif
+}
+
+template <typename T>
+static T k_min(const T* a, size_t n) {
+  T lane[MATH_LANES];
+  for (size_t j = 0; j < MATH_LANES; j++) lane[j] = a[0];
+  size_t i = 0;
+  for (; i + MATH_LANES <= n; i += MATH_LANES)
+    for (size_t j = 0; j < MATH_LANES; j++) lane[j] = a[i + j] < lane[j] ? a[i + j] : lane[j];
+  T m = lane[0];
+  for (size_t j = 1; j < MATH_LANES; j++) m = lane[j] < m ? lane[j] : m;
+  for (; i < n; i++) m = a[i] < m ? a[i] : m;
+  return m;
+}
+
+template <typename T>
+static T k_max(const T* a, size_t n) {
+  T lane[MATH_LANES];
+  for (size_t j = 0; j < MATH_LANES; j++) lane[j] = a[0];
+  size_t i = 0;
+  for (; i + MATH_LANES <= n; i += MATH_LANES)
+    for (size_t j = 0; j < MATH_LANES; j++) lane[j] = a[i + j] > lane[j] ? a[i + j] : lane[j];
+  T m = lane[0];
+  for (size_t j = 1; j < MATH_LANES; j++) m = lane[j] > m ? lane[j] : m;
+  for (; i < n; i++) m = a[i] > m ? a[i] : m;
+  return m;
+}
+
+// Full convolution: out has n + m - 1 elements and must not be a or k.
+// Each kernel tap adds a scaled copy of `a` along `out`, a contiguous loop.
+template <typename T>
+static void k_convolve(const T* a, size_t n, const T* k, size_t m, T* out) {
+  memset(out, 0, (n + m - 1) * sizeof(T));
+  for (size_t j = 0; j < m; j++) {
+    T kj = k[j];
+    T* o = out + j;
+    size_t i = 0;
+    for (; i + MATH_LANES <= n; i += MATH_LANES) {
+      T t[MATH_LANES];
+      for (size_t l = 0; l < MATH_LANES; l++) t[l] = add_wrap(o[i + l], mul_wrap(a[i + l], kj));
+      for (size_t l = 0; l < MATH_LANES; l++) o[i + l] = t[l];
+    }
+    for (; i < n; i++) o[i] = add_wrap(o[i], mul_wrap(a[i], kj));
+  }
+}
+
+static void convolve_f32(const float* a, size_t n, const float* k, size_t m, float* out) {
+#ifdef LESP_ESP_DSP
+  if (n >= m) {
+    dsps_conv_f32(a, (int)n, k, (int)m, out);
+    return;
+  }
+#endif
+  k_convolve(a, n, k, m, out);
+}
+
+// Mean of every run of w consecutive elements: n - w + 1 of them. The
+// running sum is kept in double so a long signal does not drift.
+template <typename T>
+static void k_window_mean(const T* a, size_t n, size_t w, float* out) {
+  double s = 0;
+  for (size_t i = 0; i < w; i++) s += a[i];
+  out[0] = (float)(s / w);
+  for (size_t i = w; i < n; i++) {
+    s += (double)a[i] - a[i - w];
+    out[i - w + 1] = (float)(s / w);
+  }
+}
+
+template <typename T>
+static void fill(NumArray<T>* arr, const Value& src) {
+  if (src.type == V_LIST) {
+    const ValueList& items = src.list();
+    for (size_t i = 0; i < items.size(); i++) arr->v[i] = element<T>(items[i].num());
+  } else if (src.type == V_HANDLE) {
+    HandleObj* h = static_cast<HandleObj*>(src.obj);
+    if (!is_f32(h)) arr->v.assign(i32(h)->v.begin(), i32(h)->v.end());
+    else
+      for (size_t i = 0; i < arr->v.size(); i++) arr->v[i] = element<T>(f32(h)->v[i]);
+  }
+}
+
+// (math.f32 src) and (math.i32 src) make a packed array from a list of
+// numbers, from another array, or of `src` zeros.
+template <typename T>
+static Value make_from(const std::vector<Value>& args) {
+  if (args.empty()) return Value::Nil();
+  const Value& src = args[0];
+  size_t n = 0;
+  if (src.type == V_INT && src.i > 0) n = src.i;
+  else if (src.type == V_LIST) n = src.list().size();
+  else if (HandleObj* h = array_arg(args, 0)) n = array_size(h);
+  NumArray<T>* arr = make_array<T>(n);
+  fill(arr, src);
+  return Value::Handle(arr);
+}
+
+Value b_math_f32(const std::vector<Value>& args, Env*) {
+  return make_from<float>(args);
+}
+
+Value b_math_i32(const std::vector<Value>& args, Env*) {
+  return make_from<int32_t>(args);
+}
+
+Value b_math_size(const std::vector<Value>& args, Env*) {
+  HandleObj* h = array_arg(args, 0);
+  return Value::Int(h ? array_size(h) : 0);
+}
+
+// (math.at a i)
+Value b_math_at(const std::vector<Value>& args, Env*) {
+  HandleObj* h = array_arg(args, 0);
+  if (!h || args.size() < 2 || args[1].i < 0 || (size_t)args[1].i >= array_size(h)) return Value::Nil();
+  if (is_f32(h)) return Value::Float(f32(h)->v[args[1].i]);
+  return Value::Int(i32(h)->v[args[1].i]);
+}
+
+// (math.put! a i x) stores in place and returns a.
+Value b_math_put(const std::vector<Value>& args, Env*) {
+  HandleObj* h = array_arg(args, 0);
+  if (!h || args.size() < 3 || args[1].i < 0 || (size_t)args[1].i >= array_size(h)) return Value::Nil();
+  if (is_f32(h)) f32(h)->v[args[1].i] = element<float>(args[2].num());
+  else i32(h)->v[args[1].i] = element<int32_t>(args[2].num());
+  return args[0];
+}
+
+Value b_math_to_list(const std::vector<Value>& args, Env*) {
+  HandleObj* h = array_arg(args, 0);
+  ValueList out;
+  if (!h) return Value::List(std::move(out));
+  size_t n = array_size(h);
+  out.reserve(n);
+  for (size_t i = 0; i < n; i++)
+    out.push_back(is_f32(h) ? Value::Float(f32(h)->v[i]) : Value::Int(i32(h)->v[i]));
+  return Value::List(std::move(out));
+}
+
+Value b_math_sum(const std::vector<Value>& args, Env*) {
+  HandleObj* h = array_arg(args, 0);
+  if (!h) return Value::Int(0);
+  if (is_f32(h)) return Value::Float(k_sum<float, float>(f32(h)->v.data(), f32(h)->v.size()));
+  return number((double)k_sum<int32_t, int64_t>(i32(h)->v.data(), i32(h)->v.size()));
+}
+
+// (math.dot a b) over the shorter of the two.
+Value b_math_dot(const std::vector<Value>& args, Env*) {
+  HandleObj* a = array_arg(args, 0);
+  HandleObj* b = array_arg(args, 1);
+  if (!a || !b) return Value::Int(0);
+  size_t n = std::min(array_size(a), array_size(b));
+  if (!is_f32(a) && !is_f32(b)) return number((double)k_dot<int32_t, int64_t>(i32(a)->v.data(), i32(b)->v.data(), n));
+  std::vector<float> ta, tb;
+  return Value::Float(dot_f32(as_f32(a, ta), as_f32(b, tb), n));
+}
+
+// (math.scale a k [out]) is every element times k: an i32 array for an
+// i32 array and an int k, else f32.
+Value b_math_scale(const std::vector<Value>& args, Env*) {
+  HandleObj* a = array_arg(args, 0);
+  if (!a || args.size() < 2) return Value::Nil();
+  size_t n = array_size(a);
+  if (!is_f32(a) && args[1].type == V_INT) {
+    I32Array* out = result<int32_t>(args, 2, n);
+    k_scale<int32_t>(i32(a)->v.data(), args[1].i, out->v.data(), n);
+    return Value::Handle(out);
+  }
+  std::vector<float> ta;
+  const float* src = as_f32(a, ta);
+  F32Array* out = result<float>(args, 2, n);
+  scale_f32(src, (float)args[1].num(), out->v.data(), n);
+  return Value::Handle(out);
+}
+
+// (math.add a b [out]) adds arrays element by element, over the shorter,
+// or a number to every element. The result is i32 only if both are ints.
+Value b_math_add(const std::vector<Value>& args, Env*) {
+  HandleObj* a = array_arg(args, 0);
+  if (!a || args.size() < 2) return Value::Nil();
+  HandleObj* b = array_arg(args, 1);
+  if (!b && args[1].type != V_INT && args[1].type != V_FLOAT) return Value::Nil();
+  size_t n = b ? std::min(array_size(a), array_size(b)) : array_size(a);
+  bool ints = !is_f32(a) && (b ? !is_f32(b) : args[1].type == V_INT);
+
+  if (ints) {
+    I32Array* out = result<int32_t>(args, 2, n);
+    if (b) k_add(i32(a)->v.data(), i32(b)->v.data(), out->v.data(), n);
+    else k_add_scalar<int32_t>(i32(a)->v.data(), args[1].i, out->v.data(), n);
+    return Value::Handle(out);
+  }
+  std::vector<float> ta, tb;
+  const float* x = as_f32(a, ta);
+  const float* y = b ? as_f32(b, tb) : nullptr;
+  F32Array* out = result<float>(args, 2, n);
+  if (y) add_f32(x, y, out->v.data(), n);
+  else k_add_scalar(x, (float)args[1].num(), out->v.data(), n);
+  return Value::Handle(out);
+}
+
+// (math.map-sin a [out]) is the sine of every element, as f32.
+Value b_math_map_sin(const std::vector<Value>& args, Env*) {
+  HandleObj* a = array_arg(args, 0);
+  if (!a) return Value::Nil();
+  size_t n = array_size(a);
+  std::vector<float> ta;
+  const float* src = as_f32(a, ta);
+  F32Array* out = result<float>(args, 1, n);
+  float* dst = out->v.data();
+  for (size_t i = 0; i < n; i++) dst[i] = sinf(src[i]);
+  return Value::Handle(out);
+}
+
+// (math.argmax a) is the index of the first largest element, -1 if a is
+// empty.
+Value b_math_argmax(const std::vector<Value>& args, Env*) {
+  HandleObj* a = array_arg(args, 0);
+  if (!a || !array_size(a)) return Value::Int(-1);
+  size_t n = array_size(a);
+  size_t i = 0;
+  if (is_f32(a)) {
+    const float* v = f32(a)->v.data();
+    float m = k_max(v, n);
+    while (i < n && v[i] != m) i++;
+  } else {
+    const int32_t* v = i32(a)->v.data();
+    int32_t m = k_max(v, n);
+    while (v[i] != m) i++;
+  }
+  return Value::Int(i < n ? (int)i : 0);
+}
+
+// (math.convolve a k [out]) is the full convolution of a with kernel k,
+// n + m - 1 elements; i32 only if both are.
+Value b_math_convolve(const std::vector<Value>& args, Env*) {
+  HandleObj* a = array_arg(args, 0);
+  HandleObj* k = array_arg(args, 1);
+  if (!a || !k || !array_size(a) || !array_size(k)) return Value::Nil();
+  size_t n = array_size(a), m = array_size(k);
+  HandleObj* dest = array_arg(args, 2);
+  size_t out_arg = dest == a || dest == k ? args.size() : 2;
+
+  if (!is_f32(a) && !is_f32(k)) {
+    I32Array* out = result<int32_t>(args, out_arg, n + m - 1);
+    k_convolve(i32(a)->v.data(), n, i32(k)->v.data(), m, out->v.data());
+    return Value::Handle(out);
+  }
+  std::vector<float> ta, tk;
+  const float* x = as_f32(a, ta);
+  const float* y = as_f32(k, tk);
+  F32Array* out = result<float>(args, out_arg, n + m - 1);
+  convolve_f32(x, n, y, m, out->v.data());
+  return Value::Handle(out);
+}
+
+// (math.window-mean a w [out]) is the moving average over w elements, as
+// f32 with n - w + 1 elements.
+Value b_math_window_mean(const std::vector<Value>& args, Env*) {
+  HandleObj* a = array_arg(args, 0);
+  if (!a || args.size() < 2 || args[1].i < 1 || (size_t)args[1].i > array_size(a)) return Value::Nil();
+  size_t n = array_size(a), w = args[1].i;
+  size_t out_arg = array_arg(args, 2) == a ? args.size() : 2;
+  F32Array* out = result<float>(args, out_arg, n - w + 1);
+  if (is_f32(a)) k_window_mean(f32(a)->v.data(), n, w, out->v.data());
+  else k_window_mean(i32(a)->v.data(), n, w, out->v.data());
+  return Value::Handle(out);
+}
+
+// (math.min x ...) and (math.max x ...) over numbers, or over the elements
+// of one array. The result is an int when every input is.
+Value b_min(const std::vector<Value>& args, Env*) {
+  if (HandleObj* h = array_arg(args, 0)) {
+    if (!array_size(h)) return Value::Nil();
+    if (is_f32(h)) return Value::Float(k_min(f32(h)->v.data(), f32(h)->v.size()));
+    return Value::Int(k_min(i32(h)->v.data(), i32(h)->v.size()));
+  }
+  if (args.empty()) return Value::Nil();
+  Value m = args[0];
+  for (size_t i = 1; i < args.size(); i++)
+    if (args[i].num() < m.num()) m = args[i];
+  bool ints = true;
+  for (const Value& v : args) ints = ints && v.type == V_INT;
+  return ints ? Value::Int(m.i) : Value::Float(m.num());
+}
+
+Value b_max(const std::vector<Value>& args, Env*) {
+  if (HandleObj* h = array_arg(args, 0)) {
+    if (!array_size(h)) return Value::Nil();
+    if (is_f32(h)) return Value::Float(k_max(f32(h)->v.data(), f32(h)->v.size()));
+    return Value::Int(k_max(i32(h)->v.data(), i32(h)->v.size()));
+  }
+  if (args.empty()) return Value::Nil();
+  Value m = args[0];
+  for (size_t i = 1; i < args.size(); i++)
+    if (args[i].num() > m.num()) m = args[i];
+  bool ints = true;
+  for (const Value& v : args) ints = ints && v.type == V_INT;
+  return ints ? Value::Int(m.i) : Value::Float(m.num());
+}
+
 void load_math_lib(Env* env) {
   env->define("sqrt", Value::Func(b_sqrt));
   env->define("abs", Value::Func(b_abs));
@@ -100,6 +596,20 @@ void load_math_lib(Env* env) {
   env->define("arcsin", Value::Func(b_asin));
   env->define("arccos", Value::Func(b_acos));
   env->define("arctan", Value::Func(b_atan));
+  env->define("f32", Value::Func(b_math_f32));
+  env->define("i32", Value::Func(b_math_i32));
+  env->define("size", Value::Func(b_math_size));
+  env->define("at", Value::Func(b_math_at));
+  env->define("put!", Value::Func(b_math_put));
+  env->define("to-list", Value::Func(b_math_to_list));
+  env->define("sum", Value::Func(b_math_sum));
+  env->define("dot", Value::Func(b_math_dot));
+  env->define("scale", Value::Func(b_math_scale));
+  env->define("add", Value::Func(b_math_add));
+  env->define("map-sin", Value::Func(b_math_map_sin));
+  env->define("argmax", Value::Func(b_math_argmax));
+  env->define("convolve", Value::Func(b_math_convolve));
+  env->define("window-mean", Value::Func(b_math_window_mean));
   env->define("pi", Value::Float(M_PI));
   env->define("e", Value::Float(M_E));
 }
\ No newline at end of file
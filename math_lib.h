@@ -3,6 +3,11 @@
 
 #include "interpreter.h"
 
+// Elements the array kernels work on per step: independent lanes the
+// compiler can pack into one SIMD register (two on 128-bit hosts), with a
+// scalar loop for the rest.
+constexpr size_t MATH_LANES = 8;
+
 void load_math_lib(Env* env);
 
-#endif
\ No newline at end of file
+#endif
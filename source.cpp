@@ -0,0 +1,41 @@
+#include "source.h"
+#include <algorithm>
+#include <cstring>
+
+size_t strip_cr(char* buf, size_t n) {
+  char* cr = static_cast<char*>(memchr(buf, '\r', n));
+  if (!cr) return n;
+  char* out = cr;
+  for (const char* p = cr + 1; p < buf + n; p++)
+    if (*p != '\r') *out++ = *p;
+  return out - buf;
+}
+
+size_t FileReader::read(char* buf, size_t n) {
+  if (!file) return 0;
+  for (;;) {
+    size_t got = file.read(reinterpret_cast<uint8_t*>(buf), std::min(n, SOURCE_BLOCK));
+    if (!got) return 0;
+    got = strip_cr(buf, got);
+    if (got) return got;
+  }
+}
+
+bool read_file(const char* path, std::string& out) {
+  File f = SD.open(path);
+  if (!f) return false;
+
+  size_t size = f.size();
+  out.resize(size);
+  size_t len = 0;
+  while (len < size) {
+    size_t want = std::min(size - len, 8 * SOURCE_BLOCK);
+    size_t got = f.read(reinterpret_cast<uint8_t*>(&out[len]), want);
+    if (!got) break;
+    len += got;
+  }
+  f.close();
+
+  out.resize(strip_cr(&out[0], len));
+  return true;
+}
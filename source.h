@@ -0,0 +1,37 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <SD.h>
+#include <string>
+
+// Bytes moved per SD read when streaming a script or loading a file.
+constexpr size_t SOURCE_BLOCK = 512;
+
+// Script text arriving in pieces. read() fills up to `n` bytes of `buf`
+// and returns how many it wrote, 0 once the text is exhausted. Carriage
+// returns never reach the reader's caller.
+struct SourceReader {
+  virtual ~SourceReader() {}
+  virtual size_t read(char* buf, size_t n) = 0;
+};
+
+// Streams an open SD file in SOURCE_BLOCK-sized reads, so a script is
+// parsed without ever being held in RAM whole. Closes the file when done.
+struct FileReader : SourceReader {
+  File file;
+
+  explicit FileReader(File f) : file(f) {}
+  ~FileReader() {
+    file.close();
+  }
+  size_t read(char* buf, size_t n) override;
+};
+
+// Removes every '\r' from buf in place and returns the new length.
+size_t strip_cr(char* buf, size_t n);
+
+// Reads a whole file into `out`, sized once from the file's length and
+// filled in large blocks. Returns false if the file cannot be opened.
+bool read_file(const char* path, std::string& out);
+
+#endif
@@ -1,37 +1,67 @@
 #include "sys_lib.h"
+#include "gc.h"
 #include <Arduino.h>
-#include <Adafruit_ST7735.h>
-
-extern Adafruit_ST7735 tft;
-extern int cursorX;
-extern int cursorY;
+#include "term.h"
 
 Value b_cls(const std::vector<Value>&, Env*) {
-  tft.fillScreen(ST77XX_BLACK);
-  cursorX = 0;
-  cursorY = 0;
+  term_clear();
   return Value::Nil();
 }
 
+Value b_sys_scroll(const std::vector<Value>& args, Env*) {
+  int lines = args.empty() ? -TERM_LINES : (int)args[0].num();
+  return Value::Int(term_scroll(lines));
+}
+
+Value b_sys_display(const std::vector<Value>&, Env*) {
+  TermStats s = term_stats();
+  return Value::List({ Value::Int(s.capacity), Value::Int(s.peak), Value::Int(s.dropped) });
+}
+
+Value b_sys_overflow(const std::vector<Value>& args, Env*) {
+  if (args.empty() || args[0].type != V_STRING) return Value::Int(0);
+  const std::string& policy = args[0].str();
+  if (policy == "block") term_set_overflow(TERM_BLOCK);
+  else if (policy == "drop") term_set_overflow(TERM_DROP);
+  else if (policy == "coalesce") term_set_overflow(TERM_COALESCE);
+  else return Value::Int(0);
+  return Value::Int(1);
+}
+
 Value b_sys_time(const std::vector<Value>&, Env*) {
   return Value::Int(millis());
 }
 
 Value b_sys_delay(const std::vector<Value>& args, Env*) {
   if (args.empty()) return Value::Nil();
-  int ms = (args[0].type == V_INT) ? args[0].i : (int)args[0].f;
-  delay(ms);
+  int ms = (int)args[0].num();
+  Lesp::current->sleep(ms > 0 ? ms : 0);
   return Value::Nil();
 }
 
 Value b_sys_exit(const std::vector<Value>&, Env*) {
-  vTaskDelete(NULL);
+  Lesp::current->halted = true;
   return Value::Nil();
 }
 
+Value b_sys_heap(const std::vector<Value>&, Env*) {
+  HeapStats& s = Lesp::current->heap->stats;
+  return Value::List({ Value::Int(s.bytes), Value::Int(s.objects), Value::Int(s.peak), Value::Int(s.cycles) });
+}
+
+Value b_sys_gc(const std::vector<Value>&, Env*) {
+  Lesp::current->collect();
+  return Value::Int(Lesp::current->heap->stats.bytes);
+}
+
 void load_sys_lib(Env* env) {
   env->define("cls", Value::Func(b_cls));
+  env->define("scroll", Value::Func(b_sys_scroll));
+  env->define("display", Value::Func(b_sys_display));
+  env->define("overflow", Value::Func(b_sys_overflow));
   env->define("time", Value::Func(b_sys_time));
   env->define("delay", Value::Func(b_sys_delay));
   env->define("exit", Value::Func(b_sys_exit));
+  env->define("heap", Value::Func(b_sys_heap));
+  env->define("gc", Value::Func(b_sys_gc));
 }
\ No newline at end of file
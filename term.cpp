@@ -0,0 +1,390 @@
+#include "term.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <Adafruit_GFX.h>
+
+extern Adafruit_ST7735 tft;
+extern SemaphoreHandle_t termMutex;
+
+void (*term_sink)(const char* s, size_t n) = nullptr;
+
+struct Cell {
+  char ch;
+  uint16_t color;
+
+  bool operator==(const Cell& o) const {
+    return ch == o.ch && color == o.color;
+  }
+};
+
+static const Cell BLANK = { ' ', ST77XX_WHITE };
+
+// Output lives in a ring of TERM_LINES lines addressed by ever-increasing
+// line numbers; `head` is the line the cursor is on and `first` the line on
+// the top row while following output. Scrolling back moves the view up by
+// `offset` lines. `shown` is what the panel last got, and each screen row
+// remembers the span of columns that may differ from it.
+struct Term {
+  int cols = 0;
+  int rows = 0;
+  int lines = 0;
+  int col = 0;
+  long head = 0;
+  long first = 0;
+  long offset = 0;
+  std::vector<Cell> ring;
+  std::vector<Cell> shown;
+  std::vector<Cell> blank;
+  std::vector<int> dirty_lo;
+  std::vector<int> dirty_hi;
+  GFXcanvas16* canvas = nullptr;
+
+  Cell* line(long n) {
+    return &ring[(n % lines) * cols];
+  }
+  long oldest() const {
+    return std::max(0L, head - lines + 1);
+  }
+  long top() const {
+    return std::max(oldest(), first - offset);
+  }
+
+  void layout();
+  void touch(int r, int lo, int hi);
+  void touch_all();
+  void follow();
+  void put(char c, uint16_t color);
+  void newline();
+  void backspace();
+  void page();
+  int scroll(int n);
+  void flush();
+  void flush_row(int r);
+};
+
+static Term term;
+
+// Sized on first use, after setup() has rotated the panel.
+void Term::layout() {
+  cols = tft.width() / CHAR_W;
+  rows = tft.height() / CHAR_H;
+  lines = std::max(TERM_LINES, rows);
+  ring.assign(lines * cols, BLANK);
+  shown.assign(rows * cols, BLANK);
+  blank.assign(cols, BLANK);
+  dirty_lo.assign(rows, cols);
+  dirty_hi.assign(rows, 0);
+  canvas = new GFXcanvas16(cols * CHAR_W, CHAR_H);
+}
+
+void Term::touch(int r, int lo, int hi) {
+  if (r < 0 || r >= rows) return;
+  if (lo < dirty_lo[r]) dirty_lo[r] = lo;
+  if (hi > dirty_hi[r]) dirty_hi[r] = hi;
+}
+
+void Term::touch_all() {
+  for (int r = 0; r < rows; r++) touch(r, 0, cols);
+}
+
+// New output always brings a scrolled-back view back to the cursor.
+void Term::follow() {
+  if (!offset) return;
+  offset = 0;
+  touch_all();
+}
+
+void Term::put(char c, uint16_t color) {
+  follow();
+  if (c == '\n') {
+    newline();
+    return;
+  }
+  line(head)[col] = { c, color };
+  touch(head - first, col, col + 1);
+  if (++col >= cols) newline();
+}
+
+// Starting a line past the bottom scrolls the screen by one row. Every row
+// then shows different text, but the flush still only sends cells whose
+// character or color changed.
+void Term::newline() {
+  head++;
+  col = 0;
+  std::fill(line(head), line(head) + cols, BLANK);
+  if (head - first >= rows) {
+    first = head - rows + 1;
+    touch_all();
+  }
+}
+
+void Term::backspace() {
+  follow();
+  if (col > 0) {
+    col--;
+  } else if (head > first) {
+    head--;
+    col = cols - 1;
+  }
+  line(head)[col] = BLANK;
+  touch(head - first, col, col + 1);
+}
+
+// Clears the screen by starting a fresh page; what was on it stays in the
+// scrollback.
+void Term::page() {
+  offset = 0;
+  newline();
+  first = head;
+  touch_all();
+}
+
+int Term::scroll(int n) {
+  long limit = first - oldest();
+  long to = std::min(std::max(offset + n, 0L), limit);
+  if (to != offset) {
+    offset = to;
+    touch_all();
+  }
+  return (int)offset;
+}
+
+void Term::flush() {
+  for (int r = 0; r < rows; r++)
+    if (dirty_lo[r] < dirty_hi[r]) flush_row(r);
+}
+
+// Trims the row's dirty span to the cells that really differ from the
+// panel, renders them into the line canvas and sends them as one window.
+void Term::flush_row(int r) {
+  int lo = dirty_lo[r];
+  int hi = dirty_hi[r];
+  dirty_lo[r] = cols;
+  dirty_hi[r] = 0;
+
+  long n = top() + r;
+  const Cell* want = n <= head ? line(n) : blank.data();
+  Cell* have = &shown[r * cols];
+  while (lo < hi && want[lo] == have[lo]) lo++;
+  while (hi > lo && want[hi - 1] == have[hi - 1]) hi--;
+  if (lo == hi) return;
+
+  for (int c = lo; c < hi; c++) {
+    canvas->drawChar(c * CHAR_W, 0, want[c].ch, want[c].color, ST77XX_BLACK, 1);
+    have[c] = want[c];
+  }
+
+  int stride = cols * CHAR_W;
+  int w = (hi - lo) * CHAR_W;
+  uint16_t* px = canvas->getBuffer() + lo * CHAR_W;
+  tft.startWrite();
+  tft.setAddrWindow(lo * CHAR_W, r * CHAR_H, w, CHAR_H);
+  for (int y = 0; y < CHAR_H; y++) tft.writePixels(px + y * stride, w);
+  tft.endWrite();
+}
+
+// Output records travel from the printing tasks to the render task through
+// a byte ring: a 5-byte header (op, color, length or argument) followed by
+// the text. Positions run freely and are masked on access. Producers are
+// serialized by termMutex, which is held only while copying into the ring;
+// the render task takes no lock. Until term_start() runs there is no
+// render task and producers drain the ring themselves.
+enum TermOp : uint8_t {
+  TERM_TEXT,
+  TERM_BACKSPACE,
+  TERM_CLEAR,
+  TERM_SCROLL
+};
+
+static const uint32_t HEADER = 5;
+static const uint32_t MASK = TERM_QUEUE_BYTES - 1;
+
+static uint8_t queue[TERM_QUEUE_BYTES];
+static std::atomic<uint32_t> q_head(0);
+static std::atomic<uint32_t> q_tail(0);
+static std::atomic<uint32_t> q_done(0);
+static std::atomic<int> view_offset(0);
+static bool rendering = false;
+
+static TermOverflow overflow = TERM_BLOCK;
+static size_t peak = 0;
+static size_t dropped = 0;
+static size_t skipped = 0;
+
+static void copy_in(uint32_t pos, const void* src, uint32_t n) {
+  const uint8_t* p = static_cast<const uint8_t*>(src);
+  uint32_t at = pos & MASK;
+  uint32_t first = std::min(n, TERM_QUEUE_BYTES - at);
+  memcpy(queue + at, p, first);
+  memcpy(queue, p + first, n - first);
+}
+
+static void copy_out(uint32_t pos, void* dst, uint32_t n) {
+  uint8_t* p = static_cast<uint8_t*>(dst);
+  uint32_t at = pos & MASK;
+  uint32_t first = std::min(n, TERM_QUEUE_BYTES - at);
+  memcpy(p, queue + at, first);
+  memcpy(p + first, queue, n - first);
+}
+
+// Applies every record queued so far to the grid, then flushes the panel
+// once for the lot.
+static bool drain() {
+  uint32_t tail = q_tail.load(std::memory_order_relaxed);
+  uint32_t head = q_head.load(std::memory_order_acquire);
+  if (tail == head) return false;
+  if (!term.cols) term.layout();
+
+  char chunk[64];
+  while (tail != head) {
+    uint8_t h[HEADER];
+    copy_out(tail, h, HEADER);
+    uint16_t color = h[1] | (h[2] << 8);
+    uint16_t arg = h[3] | (h[4] << 8);
+    tail += HEADER;
+
+    switch (h[0]) {
+      case TERM_TEXT:
+        for (uint32_t done = 0; done < arg;) {
+          uint32_t n = std::min<uint32_t>(arg - done, sizeof(chunk));
+          copy_out(tail + done, chunk, n);
+          for (uint32_t i = 0; i < n; i++) term.put(chunk[i], color);
+          if (term_sink) term_sink(chunk, n);
+          done += n;
+        }
+        tail += arg;
+        break;
+      case TERM_BACKSPACE: term.backspace(); break;
+      case TERM_CLEAR: term.page(); break;
+      case TERM_SCROLL: view_offset.store(term.scroll((int16_t)arg)); break;
+    }
+    q_tail.store(tail, std::memory_order_release);
+  }
+
+  term.flush();
+  q_done.store(tail, std::memory_order_release);
+  return true;
+}
+
+static void render_task(void*) {
+  for (;;)
+    if (!drain()) vTaskDelay(TERM_IDLE_TICKS);
+}
+
+// Waits for `n` bytes of room, or makes it by draining in place when there
+// is no render task.
+static bool reserve(uint32_t n, bool wait) {
+  for (;;) {
+    uint32_t used = q_head.load(std::memory_order_relaxed) - q_tail.load(std::memory_order_acquire);
+    if (used + n <= TERM_QUEUE_BYTES) {
+      if (used + n > peak) peak = used + n;
+      return true;
+    }
+    if (!rendering) drain();
+    else if (!wait) return false;
+    else vTaskDelay(1);
+  }
+}
+
+static void push(uint8_t op, uint16_t color, uint16_t arg, const char* text, uint32_t len) {
+  uint8_t h[HEADER] = { op, (uint8_t)color, (uint8_t)(color >> 8), (uint8_t)arg, (uint8_t)(arg >> 8) };
+  uint32_t head = q_head.load(std::memory_order_relaxed);
+  copy_in(head, h, HEADER);
+  if (len) copy_in(head + HEADER, text, len);
+  q_head.store(head + HEADER + len, std::memory_order_release);
+  if (!rendering) drain();
+}
+
+static void push_control(uint8_t op, uint16_t arg) {
+  xSemaphoreTake(termMutex, portMAX_DELAY);
+  reserve(HEADER, true);
+  push(op, 0, arg, nullptr, 0);
+  xSemaphoreGive(termMutex);
+}
+
+// Under TERM_COALESCE, text that did not fit is summed up and reported by
+// one marker line as soon as there is room again.
+static bool push_skipped() {
+  char note[32];
+  uint32_t n = snprintf(note, sizeof(note), "[+%u bytes]\n", (unsigned)skipped);
+  if (!reserve(HEADER + n, overflow == TERM_BLOCK)) return false;
+  push(TERM_TEXT, ST77XX_RED, n, note, n);
+  skipped = 0;
+  return true;
+}
+
+void term_write(const char* s, size_t n, uint16_t color) {
+  const uint32_t room = TERM_QUEUE_BYTES / 2 - HEADER;
+  xSemaphoreTake(termMutex, portMAX_DELAY);
+  while (n) {
+    if (skipped && !push_skipped()) {
+      dropped += n;
+      skipped += n;
+      break;
+    }
+    uint32_t len = (uint32_t)std::min<size_t>(n, room);
+    if (!reserve(HEADER + len, overflow == TERM_BLOCK)) {
+      dropped += n;
+      if (overflow == TERM_COALESCE) skipped += n;
+      break;
+    }
+    push(TERM_TEXT, color, len, s, len);
+    s += len;
+    n -= len;
+  }
+  xSemaphoreGive(termMutex);
+}
+
+void term_clear() {
+  push_control(TERM_CLEAR, 0);
+}
+
+int term_scroll(int lines) {
+  lines = std::max(-TERM_LINES, std::min(TERM_LINES, lines));
+  push_control(TERM_SCROLL, (uint16_t)lines);
+  term_sync();
+  return view_offset.load();
+}
+
+void termPutChar(char c, uint16_t color) {
+  term_write(&c, 1, color);
+}
+
+void termBackspace() {
+  push_control(TERM_BACKSPACE, 0);
+}
+
+void term_start() {
+  if (rendering) return;
+  rendering = true;
+  xTaskCreatePinnedToCore(render_task, "RenderTask", 4096, NULL, 1, NULL, 0);
+}
+
+void term_sync() {
+  xSemaphoreTake(termMutex, portMAX_DELAY);
+  if (skipped) {
+    reserve(HEADER + 32, true);
+    push_skipped();
+  }
+  uint32_t head = q_head.load(std::memory_order_relaxed);
+  xSemaphoreGive(termMutex);
+  // Other jobs may queue more meanwhile, and drain() can then finish past
+  // `head`; the offsets wrap, so compare by their difference.
+  while ((int32_t)(q_done.load(std::memory_order_acquire) - head) < 0) vTaskDelay(1);
+}
+
+void term_set_overflow(TermOverflow policy) {
+  xSemaphoreTake(termMutex, portMAX_DELAY);
+  overflow = policy;
+  xSemaphoreGive(termMutex);
+}
+
+TermStats term_stats() {
+  xSemaphoreTake(termMutex, portMAX_DELAY);
+  TermStats s = { TERM_QUEUE_BYTES, peak, dropped };
+  xSemaphoreGive(termMutex);
+  return s;
+}
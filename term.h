@@ -0,0 +1,55 @@
+#ifndef TERM_H
+#define TERM_H
+
+#include <Arduino.h>
+#include <Adafruit_ST7735.h>
+
+constexpr int CHAR_W = 6;
+constexpr int CHAR_H = 8;
+
+// Lines of output kept for scrolling back, the visible screen included.
+constexpr int TERM_LINES = 64;
+
+// Bytes of pending output between the printing tasks and the render task
+// (a power of two), and how long the render task sleeps when it is idle.
+constexpr uint32_t TERM_QUEUE_BYTES = 4096;
+constexpr TickType_t TERM_IDLE_TICKS = 2;
+
+// What a print does when the render task has fallen a full queue behind:
+// wait for room, discard the text, or discard it and later print how much
+// was skipped.
+enum TermOverflow : uint8_t {
+  TERM_BLOCK,
+  TERM_DROP,
+  TERM_COALESCE
+};
+
+struct TermStats {
+  size_t capacity;
+  size_t peak;
+  size_t dropped;
+};
+
+// Text terminal on the TFT. Writes are queued for a render task on the
+// other core, which applies them to a grid of character cells kept in RAM
+// and sends only cells that changed to the panel, one address window per
+// run of changed cells on a line. Output past the bottom row scrolls the
+// screen by a line.
+void term_start();
+void term_write(const char* s, size_t n, uint16_t color = ST77XX_WHITE);
+void term_clear();
+// Moves the view `lines` back into the scrollback (negative: towards the
+// cursor) and returns how far back it now is. New output returns to the
+// cursor.
+int term_scroll(int lines);
+void termPutChar(char c, uint16_t color = ST77XX_WHITE);
+void termBackspace();
+// Waits until everything written so far is on the panel.
+void term_sync();
+void term_set_overflow(TermOverflow policy);
+TermStats term_stats();
+
+// Optional copy of everything written, for hosts without a panel.
+extern void (*term_sink)(const char* s, size_t n);
+
+#endif
@@ -0,0 +1,925 @@
+#include "vm.h"
+#include "gc.h"
+#include <algorithm>
+
+Proto::~Proto() {
+  for (Proto* p : protos) delete p;
+}
+
+size_t op_size(uint8_t op) {
+  switch (op) {
+    case OP_NIL:
+    case OP_POP:
+    case OP_RETURN: return 1;
+    case OP_LOAD_UP:
+    case OP_STORE_UP: return 4;
+    case OP_STORE_MEMBER: return 5;
+    default: return op <= OP_ERROR ? 3 : 0;
+  }
+}
+
+size_t op_symbols(uint8_t op) {
+  switch (op) {
+    case OP_LOAD_GLOBAL:
+    case OP_STORE_GLOBAL:
+    case OP_DEF_GLOBAL:
+    case OP_MEMBER:
+    case OP_INCLUDE: return 1;
+    case OP_STORE_MEMBER: return 2;
+    default: return 0;
+  }
+}
+
+struct SpecialForms {
+  SymbolId def = intern("def");
+  SymbolId set = intern("set!");
+  SymbolId begin = intern("begin");
+  SymbolId if_ = intern("if");
+  SymbolId while_ = intern("while");
+  SymbolId lambda = intern("lambda");
+  SymbolId include = intern("include");
+  SymbolId loop = intern("loop");
+  SymbolId recur = intern("recur");
+};
+
+static const SpecialForms& forms() {
+  static SpecialForms f;
+  return f;
+}
+
+static bool is_form(const Value& e, SymbolId head) {
+  if (e.type != V_LIST || e.list().empty()) return false;
+  const Value& h = e.list()[0];
+  return h.type == V_SYMBOL && h.sym == head;
+}
+
+// A name is declared for its whole block as soon as the block is entered, but
+// only becomes visible to code in the same function once its `def` has been
+// compiled. Nested lambdas run later and see every declaration, which keeps
+// local recursion and forward references working.
+struct Binding {
+  SymbolId sym;
+  uint16_t slot;
+  bool live;
+};
+
+// Where `recur` jumps to: the start of the innermost loop body, or of the
+// function itself, rebinding `slots` from its arguments.
+struct LoopTarget {
+  size_t start;
+  std::vector<uint16_t> slots;
+};
+
+struct FnScope {
+  FnScope* enclosing;
+  Proto* p;
+  bool top;
+  std::vector<std::vector<Binding>> blocks;
+  std::vector<LoopTarget> loops;
+};
+
+// Position of the expression being compiled: TAIL_FN when its value is
+// returned straight from the function, TAIL_LOOP when it is the value of
+// the innermost loop (or function) body, where `recur` is allowed.
+enum Tail : uint8_t {
+  TAIL_NONE = 0,
+  TAIL_FN = 1,
+  TAIL_LOOP = 2
+};
+
+struct Compiler {
+  FnScope* fn;
+
+  Compiler(FnScope* scope) : fn(scope) {}
+
+  Proto* p() {
+    return fn->p;
+  }
+
+  void emit(uint8_t b) {
+    p()->code.push_back(b);
+  }
+
+  void emit16(uint16_t v) {
+    p()->code.push_back(v & 0xff);
+    p()->code.push_back(v >> 8);
+  }
+
+  void emit_op16(uint8_t op, uint16_t v) {
+    emit(op);
+    emit16(v);
+  }
+
+  // String literals are copied out of the parse tree, which is rewound as
+  // soon as the form is compiled.
+  uint16_t constant(const Value& v) {
+    p()->consts.push_back(v.type == V_STRING ? Value::String(v.str()) : v);
+    return p()->consts.size() - 1;
+  }
+
+  size_t jump(uint8_t op) {
+    emit_op16(op, 0);
+    return p()->code.size();
+  }
+
+  void patch(size_t from) {
+    int16_t off = p()->code.size() - from;
+    p()->code[from - 2] = off & 0xff;
+    p()->code[from - 1] = (uint16_t)off >> 8;
+  }
+
+  void jump_back(size_t to) {
+    int16_t off = (int)to - (int)(p()->code.size() + 3);
+    emit_op16(OP_JUMP, (uint16_t)off);
+  }
+
+  bool globals_here() {
+    return fn->top && fn->blocks.size() == 1;
+  }
+
+  Binding* declare(SymbolId sym) {
+    for (auto& b : fn->blocks.back())
+      if (b.sym == sym) return &b;
+    fn->blocks.back().push_back({ sym, p()->nslots++, false });
+    return &fn->blocks.back().back();
+  }
+
+  void hoist(const Value& e) {
+    if (e.type != V_LIST) return;
+    if (is_form(e, forms().begin) || is_form(e, forms().lambda) || is_form(e, forms().loop)) return;
+    const ValueList& items = e.list();
+    if (is_form(e, forms().def) && items.size() > 1) declare(items[1].sym);
+    for (auto& item : items) hoist(item);
+  }
+
+  bool resolve(SymbolId sym, uint8_t& depth, uint16_t& slot) {
+    depth = 0;
+    for (FnScope* s = fn; s; s = s->enclosing, depth++) {
+      for (size_t b = s->blocks.size(); b-- > 0;) {
+        for (auto& binding : s->blocks[b]) {
+          if (binding.sym != sym || (s == fn && !binding.live)) continue;
+          slot = binding.slot;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  void load(SymbolId sym) {
+    uint8_t depth;
+    uint16_t slot;
+    if (!resolve(sym, depth, slot)) {
+      emit_op16(OP_LOAD_GLOBAL, sym);
+    } else if (depth == 0) {
+      emit_op16(OP_LOAD_LOCAL, slot);
+    } else {
+      emit(OP_LOAD_UP);
+      emit(depth);
+      emit16(slot);
+    }
+  }
+
+  void store(SymbolId sym) {
+    const std::string& name = symbol_name(sym);
+    size_t dot = name.find('.');
+    if (dot != std::string::npos) {
+      emit_op16(OP_STORE_MEMBER, intern(name.substr(0, dot)));
+      emit16(intern(name.substr(dot + 1)));
+      return;
+    }
+    uint8_t depth;
+    uint16_t slot;
+    if (!resolve(sym, depth, slot)) {
+      emit_op16(OP_STORE_GLOBAL, sym);
+    } else if (depth == 0) {
+      emit_op16(OP_STORE_LOCAL, slot);
+    } else {
+      emit(OP_STORE_UP);
+      emit(depth);
+      emit16(slot);
+    }
+  }
+
+  void arg(const ValueList& list, size_t i, uint8_t tail = TAIL_NONE) {
+    if (i < list.size()) expr(list[i], tail);
+    else emit(OP_NIL);
+  }
+
+  void error(const char* msg) {
+    p()->consts.push_back(Value::String(msg));
+    emit_op16(OP_ERROR, p()->consts.size() - 1);
+  }
+
+  void symbol(SymbolId sym) {
+    const std::string& name = symbol_name(sym);
+    size_t dot = name.find('.');
+    if (dot == std::string::npos) {
+      load(sym);
+      return;
+    }
+    load(intern(name.substr(0, dot)));
+    emit_op16(OP_MEMBER, intern(name.substr(dot + 1)));
+  }
+
+  void expr(const Value& e, uint8_t tail = TAIL_NONE) {
+    switch (e.type) {
+      case V_SYMBOL: symbol(e.sym); return;
+      case V_LIST: list(e.list(), tail); return;
+      case V_NIL: emit(OP_NIL); return;
+      default: emit_op16(OP_CONST, constant(e)); return;
+    }
+  }
+
+  void def(const ValueList& l) {
+    if (l.size() < 2 || l[1].type != V_SYMBOL) {
+      arg(l, 2);
+      return;
+    }
+    SymbolId sym = l[1].sym;
+    if (globals_here()) {
+      arg(l, 2);
+      emit_op16(OP_DEF_GLOBAL, sym);
+      return;
+    }
+    Binding* b = declare(sym);
+    uint16_t slot = b->slot;
+    arg(l, 2);
+    declare(sym)->live = true;
+    emit_op16(OP_STORE_LOCAL, slot);
+  }
+
+  void begin(const ValueList& l, uint8_t tail) {
+    fn->blocks.emplace_back();
+    for (size_t i = 1; i < l.size(); i++) hoist(l[i]);
+    if (l.size() == 1) emit(OP_NIL);
+    for (size_t i = 1; i < l.size(); i++) {
+      bool last = i + 1 == l.size();
+      expr(l[i], last ? tail : (uint8_t)TAIL_NONE);
+      if (!last) emit(OP_POP);
+    }
+    fn->blocks.pop_back();
+  }
+
+  // (loop (name init ...) body): binds each name in turn, then runs body;
+  // (recur v ...) in tail position rebinds them and jumps back to the top.
+  void loop(const ValueList& l, uint8_t tail) {
+    if (l.size() > 1 && !loop_bindings(l[1])) {
+      error("bad loop bindings");
+      return;
+    }
+    fn->blocks.emplace_back();
+    LoopTarget target;
+    if (l.size() > 1) {
+      const ValueList& b = l[1].list();
+      for (size_t i = 0; i < b.size(); i += 2) {
+        uint16_t slot = declare(b[i].sym)->slot;
+        arg(b, i + 1);
+        declare(b[i].sym)->live = true;
+        emit_op16(OP_STORE_LOCAL, slot);
+        emit(OP_POP);
+        target.slots.push_back(slot);
+      }
+    }
+    if (l.size() > 2) hoist(l[2]);
+    target.start = p()->code.size();
+    fn->loops.push_back(target);
+    arg(l, 2, (tail & TAIL_FN) | TAIL_LOOP);
+    fn->loops.pop_back();
+    fn->blocks.pop_back();
+  }
+
+  void recur(const ValueList& l, uint8_t tail) {
+    if (!(tail & TAIL_LOOP) || fn->loops.empty()) {
+      error("recur outside tail position");
+      return;
+    }
+    const LoopTarget& target = fn->loops.back();
+    for (size_t i = 0; i < target.slots.size(); i++) arg(l, i + 1);
+    for (size_t i = target.slots.size(); i-- > 0;) {
+      emit_op16(OP_STORE_LOCAL, target.slots[i]);
+      emit(OP_POP);
+    }
+    jump_back(target.start);
+    emit(OP_NIL);
+  }
+
+  void lambda(const ValueList& l) {
+    if (l.size() > 1 && !symbol_list(l[1])) {
+      error("bad lambda parameters");
+      return;
+    }
+    FnScope scope = { fn, new Proto(), false, { {} }, {} };
+    Compiler c(&scope);
+    if (l.size() > 1)
+      for (auto& param : l[1].list()) c.declare(param.sym)->live = true;
+    scope.p->nparams = scope.p->nslots;
+    LoopTarget self = { 0, {} };
+    for (uint16_t i = 0; i < scope.p->nparams; i++) self.slots.push_back(i);
+    scope.loops.push_back(self);
+    if (l.size() > 2) c.hoist(l[2]);
+    c.arg(l, 2, TAIL_FN | TAIL_LOOP);
+    c.emit(OP_RETURN);
+    p()->protos.push_back(scope.p);
+    emit_op16(OP_CLOSURE, p()->protos.size() - 1);
+  }
+
+  void list(const ValueList& l, uint8_t tail) {
+    if (l.empty()) {
+      emit(OP_NIL);
+      return;
+    }
+
+    const Value& head = l[0];
+    if (head.type == V_SYMBOL) {
+      const SpecialForms& F = forms();
+      SymbolId h = head.sym;
+
+      if (h == F.def) {
+        def(l);
+        return;
+      }
+
+      if (h == F.set) {
+        if (l.size() > 1 && l[1].type != V_SYMBOL) {
+          error("bad set! target");
+          return;
+        }
+        arg(l, 2);
+        if (l.size() > 1) store(l[1].sym);
+        return;
+      }
+
+      if (h == F.begin) {
+        begin(l, tail);
+        return;
+      }
+
+      if (h == F.if_) {
+        arg(l, 1);
+        size_t else_jump = jump(OP_JUMP_IF_FALSE);
+        arg(l, 2, tail);
+        size_t end_jump = jump(OP_JUMP);
+        patch(else_jump);
+        arg(l, 3, tail);
+        patch(end_jump);
+        return;
+      }
+
+      if (h == F.loop) {
+        loop(l, tail);
+        return;
+      }
+
+      if (h == F.recur) {
+        recur(l, tail);
+        return;
+      }
+
+      if (h == F.while_) {
+        emit(OP_NIL);
+        size_t top = p()->code.size();
+        arg(l, 1);
+        size_t exit_jump = jump(OP_JUMP_IF_FALSE);
+        emit(OP_POP);
+        arg(l, 2);
+        jump_back(top);
+        patch(exit_jump);
+        return;
+      }
+
+      if (h == F.lambda) {
+        lambda(l);
+        return;
+      }
+
+      if (h == F.include) {
+        if (l.size() < 2 || l[1].type != V_SYMBOL) emit(OP_NIL);
+        else emit_op16(OP_INCLUDE, l[1].sym);
+        return;
+      }
+    }
+
+    expr(head);
+    for (size_t i = 1; i < l.size(); i++) expr(l[i]);
+    emit_op16(tail & TAIL_FN ? OP_TAIL_CALL : OP_CALL, l.size() - 1);
+  }
+};
+
+Proto* compile(const Value& form) {
+  FnScope scope = { nullptr, new Proto(), true, { {} }, {} };
+  Compiler c(&scope);
+  c.expr(form);
+  c.emit(OP_RETURN);
+  return scope.p;
+}
+
+VM::VM(Lesp* l) : owner(l) {
+  stack.reserve(256);
+  frames.reserve(32);
+}
+
+VM::~VM() {
+  stop_tasks();
+  for (Frame* f : spare_frames) delete f;
+}
+
+// Frames that were not captured are recycled, so a call whose arguments
+// are immediates allocates nothing once the pool is warm.
+Frame* VM::new_frame(Frame* parent, size_t nslots) {
+  if (spare_frames.empty()) return new Frame(parent, nslots);
+  Frame* f = spare_frames.back();
+  spare_frames.pop_back();
+  f->parent = parent;
+  f->slots.assign(nslots, Value());
+  return f;
+}
+
+void VM::release_frame(Frame* frame) {
+  if (frame->captured) return;
+  if (spare_frames.size() < MAX_SPARE_FRAMES) spare_frames.push_back(frame);
+  else delete frame;
+}
+
+void Frame::trace(Heap& h) {
+  for (auto& v : slots) h.mark(v);
+  h.mark(parent);
+}
+
+static void mark_stacks(Heap& h, std::vector<Value>& stack, std::vector<CallFrame>& frames) {
+  for (auto& v : stack) h.mark(v);
+  for (auto& f : frames) {
+    h.root(f.frame);
+    h.mark(f.module);
+    h.mark(f.proto);
+  }
+}
+
+const char TASK_HANDLE[] = "task";
+
+void Coroutine::trace(Heap& h) {
+  mark_stacks(h, stack, frames);
+  h.mark(result);
+  for (Coroutine* c : waiters) h.mark(c);
+}
+
+// Tasks that have not finished are roots whether or not the script still
+// holds a handle to them.
+void VM::mark(Heap& h) {
+  mark_stacks(h, stack, frames);
+  if (running) h.root(&main_task);
+  for (Coroutine* c : live) h.root(c);
+}
+
+Value VM::run(Proto* p, Env* env) {
+  Frame* frame = new_frame(nullptr, p->nslots);
+  frames.push_back({ p, p->code.data(), stack.size(), frame, env });
+  return execute(frames.size() - 1);
+}
+
+// Entry from C++ (builtins calling back into Lesp). Each of these nests an
+// execute() on the task's C stack, so their depth is capped separately.
+Value VM::call(const Value& fn, const std::vector<Value>& args, Env* env) {
+  if (native_depth >= MAX_NATIVE_DEPTH) {
+    owner->error("stack overflow");
+    return Value::Nil();
+  }
+  size_t depth = frames.size();
+  stack.push_back(fn);
+  for (auto& a : args) stack.push_back(a);
+  suspendable = false;
+  if (!enter(args.size(), env)) {
+    Value r = stack.back();
+    stack.pop_back();
+    return r;
+  }
+  native_depth++;
+  Value r = execute(depth);
+  native_depth--;
+  return r;
+}
+
+// Calls the function sitting below the top `argc` stack slots. Builtins and
+// non-callables complete immediately, leaving their result in place of the
+// callee; Lesp lambdas push a new frame and return true.
+bool VM::enter(size_t argc, Env* env) {
+  size_t base = stack.size() - argc - 1;
+  Value& fn = stack[base];
+
+  if (fn.type == V_LAMBDA && fn.lambda->proto && frames.size() >= MAX_CALL_DEPTH) {
+    owner->error("stack overflow");
+    stack.resize(base);
+    stack.push_back(Value::Nil());
+    return false;
+  }
+
+  if (fn.type == V_LAMBDA && fn.lambda->proto) {
+    Proto* p = fn.lambda->proto;
+    Frame* frame = new_frame(fn.lambda->frame, p->nslots);
+    for (size_t i = 0; i < p->nparams && i < argc; i++)
+      frame->slots[i] = stack[base + 1 + i];
+    frames.push_back({ p, p->code.data(), base, frame, fn.lambda->env });
+    return true;
+  }
+
+  Value r;
+  if (fn.type == V_FUNC || fn.type == V_LAMBDA) {
+    Value callee = fn;
+    std::vector<Value>& args = arg_buffer(native_args++);
+    args.assign(stack.begin() + base + 1, stack.end());
+    r = callee.type == V_FUNC ? callee.fn(args, env) : apply(callee, args, env);
+    native_args--;
+    if (switching && again) return false;
+  }
+  stack.resize(base);
+  stack.push_back(r);
+  return false;
+}
+
+// Builtins take their arguments as a vector. Each nesting level of builtin
+// calls reuses one buffer instead of building a fresh vector per call.
+std::vector<Value>& VM::arg_buffer(size_t level) {
+  while (arg_buffers.size() <= level) arg_buffers.emplace_back();
+  return arg_buffers[level];
+}
+
+// Drops every frame this execute() owns after sys.exit, so the script
+// finishes through the normal return path and its heap can be freed. The
+// outermost execute() runs every task, so it drops all of theirs too.
+Value VM::unwind(size_t depth) {
+  if (depth == 0) stop_tasks();
+  if (depth < frames.size()) stack.resize(frames[depth].base);
+  while (frames.size() > depth) {
+    release_frame(frames.back().frame);
+    frames.pop_back();
+  }
+  return Value::Nil();
+}
+
+Coroutine* VM::spawn(const Value& fn, const std::vector<Value>& args) {
+  Coroutine* c = owner->heap->make<Coroutine>();
+  Proto* p = fn.lambda->proto;
+  Frame* frame = new_frame(fn.lambda->frame, p->nslots);
+  for (size_t i = 0; i < p->nparams && i < args.size(); i++) frame->slots[i] = args[i];
+  c->stack.push_back(fn);
+  c->frames.push_back({ p, p->code.data(), 0, frame, fn.lambda->env });
+  live.push_back(c);
+  ready.push_back(c);
+  return c;
+}
+
+bool VM::sleep(uint32_t ms, bool again_after) {
+  if (!suspendable) return false;
+  suspendable = false;
+  Coroutine* c = current();
+  c->state = ms ? CO_SLEEPING : CO_READY;
+  c->wake_at = millis() + ms;
+  switching = true;
+  again = again_after;
+  return true;
+}
+
+bool VM::wait(std::vector<Coroutine*>& waiters) {
+  if (!suspendable) return false;
+  suspendable = false;
+  Coroutine* c = current();
+  c->state = CO_BLOCKED;
+  waiters.push_back(c);
+  switching = true;
+  again = true;
+  return true;
+}
+
+void VM::wake(std::vector<Coroutine*>& waiters) {
+  for (Coroutine* c : waiters) {
+    if (c->state != CO_BLOCKED) continue;
+    c->state = CO_READY;
+    ready.push_back(c);
+  }
+  waiters.clear();
+}
+
+void VM::drain() {
+  if (live.empty() || owner->halted) return;
+  draining = true;
+  main_task.state = CO_BLOCKED;
+  if (reschedule() && running) execute(0);
+  draining = false;
+  stop_tasks();
+}
+
+// Acts on a builtin's request to suspend the running task, which resumes
+// at `ip`, or at the call itself if the builtin wants to be called again.
+bool VM::switch_task(const uint8_t* ip) {
+  frames.back().ip = again ? ip - 3 : ip;
+  switching = false;
+  again = false;
+  return reschedule();
+}
+
+// Files the current task according to its state and switches to the next
+// one. Returns false, with nothing switched, if the script was killed while
+// every task slept, or no task can ever run again.
+bool VM::reschedule() {
+  Coroutine* cur = current();
+  if (cur->state == CO_READY) ready.push_back(cur);
+  else if (cur->state == CO_SLEEPING) sleeping.push_back(cur);
+  Coroutine* next = next_task();
+  if (!next || next == cur) return next != nullptr;
+  cur->stack.swap(stack);
+  cur->frames.swap(frames);
+  stack.swap(next->stack);
+  frames.swap(next->frames);
+  running = next == &main_task ? nullptr : next;
+  return true;
+}
+
+// Sleeps, a slice at a time, until some task is ready. Once the main code
+// has finished and only waiting tasks are left, control goes back to it.
+Coroutine* VM::next_task() {
+  for (;;) {
+    uint32_t now = millis();
+    uint32_t wait_ms = DELAY_SLICE_MS;
+    for (size_t i = 0; i < sleeping.size();) {
+      Coroutine* c = sleeping[i];
+      int32_t left = (int32_t)(c->wake_at - now);
+      if (left > 0) {
+        if ((uint32_t)left < wait_ms) wait_ms = left;
+        i++;
+        continue;
+      }
+      c->state = CO_READY;
+      ready.push_back(c);
+      sleeping.erase(sleeping.begin() + i);
+    }
+    if (!ready.empty()) {
+      Coroutine* c = ready.front();
+      ready.pop_front();
+      return c;
+    }
+    if (sleeping.empty()) {
+      if (draining) return &main_task;
+      owner->error("deadlock: every task is waiting");
+      return nullptr;
+    }
+    if (owner->kill_requested()) return nullptr;
+    owner->flush_output();
+    delay(wait_ms);
+  }
+}
+
+void VM::finish(const Value& r) {
+  Coroutine* c = running;
+  c->state = CO_DONE;
+  c->result = r;
+  owner->heap->barrier(c);
+  wake(c->waiters);
+  live.erase(std::find(live.begin(), live.end(), c));
+}
+
+// Drops every task but main, which is switched back in.
+void VM::stop_tasks() {
+  if (running) {
+    for (CallFrame& cf : frames) release_frame(cf.frame);
+    frames.clear();
+    stack.clear();
+    stack.swap(main_task.stack);
+    frames.swap(main_task.frames);
+    running = nullptr;
+  }
+  for (Coroutine* c : live) {
+    for (CallFrame& cf : c->frames) release_frame(cf.frame);
+    c->frames.clear();
+    c->stack.clear();
+    c->state = CO_DONE;
+  }
+  live.clear();
+  ready.clear();
+  sleeping.clear();
+  main_task.state = CO_READY;
+  switching = false;
+  again = false;
+}
+
+static Value& up(Frame* frame, uint8_t depth, uint16_t slot) {
+  while (depth--) frame = frame->parent;
+  return frame->slots[slot];
+}
+
+Value VM::execute(size_t depth) {
+  CallFrame* f = &frames.back();
+  const uint8_t* ip = f->ip;
+
+#define READ16() (ip += 2, (uint16_t)(ip[-2] | (ip[-1] << 8)))
+
+  for (;;) {
+    switch (*ip++) {
+      case OP_CONST:
+        stack.push_back(f->proto->consts[READ16()]);
+        break;
+
+      case OP_NIL:
+        stack.push_back(Value::Nil());
+        break;
+
+      case OP_POP:
+        stack.pop_back();
+        break;
+
+      case OP_LOAD_LOCAL:
+        stack.push_back(f->frame->slots[READ16()]);
+        break;
+
+      case OP_STORE_LOCAL:
+        f->frame->slots[READ16()] = stack.back();
+        break;
+
+      case OP_LOAD_UP:
+        {
+          uint8_t d = *ip++;
+          stack.push_back(up(f->frame, d, READ16()));
+          break;
+        }
+
+      case OP_STORE_UP:
+        {
+          uint8_t d = *ip++;
+          uint16_t slot = READ16();
+          Frame* fr = f->frame;
+          while (d--) fr = fr->parent;
+          fr->slots[slot] = stack.back();
+          owner->heap->barrier(fr);
+          break;
+        }
+
+      case OP_LOAD_GLOBAL:
+        {
+          Value* v = f->module->lookup(READ16());
+          stack.push_back(v ? *v : Value::Nil());
+          break;
+        }
+
+      case OP_STORE_GLOBAL:
+        f->module->set_existing(READ16(), stack.back());
+        owner->heap->barrier(f->module);
+        break;
+
+      case OP_DEF_GLOBAL:
+        f->module->define(READ16(), stack.back());
+        owner->heap->barrier(f->module);
+        break;
+
+      case OP_MEMBER:
+        {
+          SymbolId sym = READ16();
+          Value& lib = stack.back();
+          Value* v = lib.type == V_LIB ? lib.lib_env->find(sym) : nullptr;
+          lib = v ? *v : Value::Nil();
+          break;
+        }
+
+      case OP_STORE_MEMBER:
+        {
+          SymbolId lib = READ16();
+          set_member(f->module, lib, READ16(), stack.back());
+          break;
+        }
+
+      case OP_JUMP:
+        {
+          int16_t off = READ16();
+          ip += off;
+          if (owner->heap->wants_step()) {
+            f->ip = ip;
+            owner->heap->step();
+          }
+          if (owner->kill_requested()) return unwind(depth);
+          break;
+        }
+
+      case OP_JUMP_IF_FALSE:
+        {
+          int16_t off = READ16();
+          if (!stack.back().i) ip += off;
+          stack.pop_back();
+          break;
+        }
+
+      case OP_CALL:
+        {
+          size_t argc = READ16();
+          f->ip = ip;
+          if (owner->heap->wants_step()) owner->heap->step();
+          if (owner->kill_requested()) return unwind(depth);
+          suspendable = depth == 0;
+          bool entered = enter(argc, f->module);
+          suspendable = false;
+          if (!entered) {
+            if (owner->halted) return unwind(depth);
+            if (switching) {
+              if (!switch_task(ip)) return unwind(depth);
+              if (frames.size() == depth) return Value::Nil();
+            }
+          }
+          f = &frames.back();
+          ip = f->ip;
+          break;
+        }
+
+      // A call whose value is returned as-is. Lesp callees take over the
+      // current frame so tail recursion runs in constant space; anything
+      // else is an ordinary call and the OP_RETURN after it finishes up.
+      case OP_TAIL_CALL:
+        {
+          size_t argc = READ16();
+          f->ip = ip;
+          if (owner->heap->wants_step()) owner->heap->step();
+          if (owner->kill_requested()) return unwind(depth);
+          size_t base = stack.size() - argc - 1;
+          Value callee = stack[base];
+          if (callee.type != V_LAMBDA || !callee.lambda->proto) {
+            suspendable = depth == 0;
+            enter(argc, f->module);
+            suspendable = false;
+            if (owner->halted) return unwind(depth);
+            if (switching) {
+              if (!switch_task(ip)) return unwind(depth);
+              if (frames.size() == depth) return Value::Nil();
+            }
+            f = &frames.back();
+            ip = f->ip;
+            break;
+          }
+          Proto* p = callee.lambda->proto;
+          Frame* frame = new_frame(callee.lambda->frame, p->nslots);
+          for (size_t i = 0; i < p->nparams && i < argc; i++)
+            frame->slots[i] = stack[base + 1 + i];
+          if (f->frame->captured) owner->heap->barrier(f->frame);
+          release_frame(f->frame);
+          stack.resize(f->base);
+          stack.push_back(callee);
+          f->proto = p;
+          f->frame = frame;
+          f->module = callee.lambda->env;
+          ip = p->code.data();
+          break;
+        }
+
+      case OP_ERROR:
+        owner->error(f->proto->consts[READ16()].str());
+        return unwind(depth);
+
+      case OP_RETURN:
+        {
+          Value r = stack.back();
+          if (f->frame->captured) owner->heap->barrier(f->frame);
+          release_frame(f->frame);
+          stack.resize(f->base);
+          frames.pop_back();
+          if (frames.size() == depth) {
+            if (depth || !running) return r;
+            finish(r);
+            if (!reschedule()) return unwind(depth);
+            if (frames.size() == depth) return Value::Nil();
+            f = &frames.back();
+            ip = f->ip;
+            break;
+          }
+          stack.push_back(r);
+          f = &frames.back();
+          ip = f->ip;
+          break;
+        }
+
+      case OP_CLOSURE:
+        {
+          Lambda* l = owner->heap->make<Lambda>();
+          l->proto = f->proto->protos[READ16()];
+          l->env = f->module;
+          l->frame = f->frame;
+          for (Frame* fr = f->frame; fr && !fr->captured; fr = fr->parent) {
+            fr->captured = true;
+            owner->heap->adopt(fr);
+          }
+          Value v;
+          v.type = V_LAMBDA;
+          v.lambda = l;
+          stack.push_back(v);
+          break;
+        }
+
+      case OP_INCLUDE:
+        {
+          SymbolId name = READ16();
+          f->ip = ip;
+          Value r = include_lib(symbol_name(name), f->module);
+          if (owner->halted) return unwind(depth);
+          f = &frames.back();
+          stack.push_back(r);
+          break;
+        }
+    }
+  }
+
+#undef READ16
+}
@@ -0,0 +1,176 @@
+#ifndef VM_H
+#define VM_H
+
+#include "interpreter.h"
+#include <deque>
+
+enum OpCode : uint8_t {
+  OP_CONST,
+  OP_NIL,
+  OP_POP,
+  OP_LOAD_LOCAL,
+  OP_STORE_LOCAL,
+  OP_LOAD_UP,
+  OP_STORE_UP,
+  OP_LOAD_GLOBAL,
+  OP_STORE_GLOBAL,
+  OP_DEF_GLOBAL,
+  OP_MEMBER,
+  OP_STORE_MEMBER,
+  OP_JUMP,
+  OP_JUMP_IF_FALSE,
+  OP_CALL,
+  OP_TAIL_CALL,
+  OP_RETURN,
+  OP_CLOSURE,
+  OP_INCLUDE,
+  OP_ERROR
+};
+
+// Lesp-to-Lesp calls live on the VM's own stacks and are bounded by
+// MAX_CALL_DEPTH; calls re-entering from C++ nest on the task's C stack and
+// are bounded far lower.
+constexpr size_t MAX_CALL_DEPTH = 512;
+constexpr size_t MAX_NATIVE_DEPTH = 16;
+constexpr size_t MAX_SPARE_FRAMES = 32;
+
+// A compiled function body (or top-level form). Operands follow their
+// opcode inline: u16 constant/proto indices, slots, symbol ids and argument
+// counts, u8 frame depths, and i16 jump offsets relative to the end of the
+// instruction. OP_STORE_MEMBER takes two symbols, the library and the
+// member.
+struct Proto {
+  std::vector<uint8_t> code;
+  std::vector<Value> consts;
+  std::vector<Proto*> protos;
+  uint16_t nparams = 0;
+  uint16_t nslots = 0;
+
+  ~Proto();
+};
+
+Proto* compile(const Value& form);
+
+// Length in bytes of the instruction starting with `op`, operands included,
+// or 0 if `op` is not an opcode. The first op_symbols() u16 operands of an
+// instruction are SymbolIds.
+size_t op_size(uint8_t op);
+size_t op_symbols(uint8_t op);
+
+// Locals of one function activation, addressed by the (depth, slot) pairs the
+// compiler resolved. A frame is freed when its call returns unless a closure
+// captured it, in which case it is handed over to the heap.
+struct Frame : Obj {
+  Frame* parent;
+  std::vector<Value> slots;
+  bool captured = false;
+
+  Frame(Frame* p, size_t n) : parent(p), slots(n) {}
+  void trace(Heap& h) override;
+  size_t footprint() const override {
+    return sizeof(Frame) + slots.capacity() * sizeof(Value);
+  }
+};
+
+struct CallFrame {
+  Proto* proto;
+  const uint8_t* ip;
+  size_t base;
+  Frame* frame;
+  Env* module;
+};
+
+enum CoState : uint8_t {
+  CO_READY,
+  CO_SLEEPING,
+  CO_BLOCKED,
+  CO_DONE
+};
+
+extern const char TASK_HANDLE[];
+
+// A green thread within one script: a spawned function with its own value
+// and call stacks. The running task's stacks are the VM's own; the others
+// keep theirs here until they are switched back in. Tasks only switch when
+// a builtin called straight from bytecode asks to sleep or wait, so at most
+// one execute() is ever on the C stack when they do.
+struct Coroutine : HandleObj {
+  std::vector<Value> stack;
+  std::vector<CallFrame> frames;
+  CoState state = CO_READY;
+  uint32_t wake_at = 0;
+  Value result;
+  std::vector<Coroutine*> waiters;
+
+  Coroutine() : HandleObj(TASK_HANDLE) {}
+  void trace(Heap& h) override;
+  size_t footprint() const override {
+    return sizeof(Coroutine) + stack.capacity() * sizeof(Value) + frames.capacity() * sizeof(CallFrame);
+  }
+};
+
+struct VM {
+  Lesp* owner;
+  std::vector<Value> stack;
+  std::vector<CallFrame> frames;
+  size_t native_depth = 0;
+  Coroutine* running = nullptr;  // null while the script's main task runs
+
+  VM(Lesp* l);
+  ~VM();
+  void mark(Heap& h);
+
+  Value run(Proto* p, Env* env);
+  Value call(const Value& fn, const std::vector<Value>& args, Env* env);
+
+  // Starts `fn` as a new task, ready to run the next time the current one
+  // sleeps, waits or yields.
+  Coroutine* spawn(const Value& fn, const std::vector<Value>& args);
+
+  // Called by builtins to suspend the running task once they return:
+  // sleep() for `ms` (0 to just yield), wait() until another task wakes
+  // `waiters`, after which the builtin is called again with the same
+  // arguments (as it is after a sleep with `again`). Both return false if
+  // the builtin was not called straight from bytecode, in which case it
+  // has to block or give up on its own.
+  bool sleep(uint32_t ms, bool again = false);
+  bool wait(std::vector<Coroutine*>& waiters);
+  void wake(std::vector<Coroutine*>& waiters);
+
+  // Runs the spawned tasks left once the script's main code has finished,
+  // until none can make progress.
+  void drain();
+
+private:
+  std::vector<Frame*> spare_frames;
+  std::deque<std::vector<Value>> arg_buffers;
+  size_t native_args = 0;
+  Coroutine main_task;
+  std::vector<Coroutine*> live;
+  std::deque<Coroutine*> ready;
+  std::vector<Coroutine*> sleeping;
+  bool suspendable = false;
+  bool switching = false;
+  bool again = false;
+  bool draining = false;
+
+  Frame* new_frame(Frame* parent, size_t nslots);
+  void release_frame(Frame* frame);
+  std::vector<Value>& arg_buffer(size_t level);
+  bool enter(size_t argc, Env* env);
+  Value execute(size_t depth);
+  Value unwind(size_t depth);
+
+  Coroutine* current() {
+    return running ? running : &main_task;
+  }
+  bool switch_task(const uint8_t* ip);
+  bool reschedule();
+  Coroutine* next_task();
+  void finish(const Value& r);
+  void stop_tasks();
+
+  friend Value apply(const Value& fn, const std::vector<Value>& args, Env* env);
+};
+
+#endif
@@ -1,4 +1,5 @@
 #include "wifi_lib.h"
+#include "vm.h"
 #include <WiFi.h>
 #include <Arduino.h>
 
@@ -6,17 +7,22 @@ Value b_wifi_connect(const std::vector<Value>& args, Env*) {
   if (args.size() < 2 || args[0].type != V_STRING || args[1].type != V_STRING)
     return Value::Int(0);
 
-  const char* ssid = args[0].str.c_str();
-  const char* pass = args[1].str.c_str();
-
-  WiFi.begin(ssid, pass);
+  Lesp* l = Lesp::current;
+  WifiState& state = l->state<WifiState>("wifi");
+  if (!state.connecting) {
+    l->flush_output();
+    WiFi.begin(args[0].str().c_str(), args[1].str().c_str());
+    state.connecting = true;
+    state.attempts = 0;
+  }
 
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 50) {
+  while (WiFi.status() != WL_CONNECTED && state.attempts < 50 && !l->kill_requested()) {
+    state.attempts++;
+    if (l->vm->sleep(100, true)) return Value::Nil();
     delay(100);
-    attempts++;
   }
 
+  state.connecting = false;
   return Value::Int(WiFi.status() == WL_CONNECTED ? 1 : 0);
 }
 
@@ -39,7 +45,7 @@ Value b_wifi_ip(const std::vector<Value>&, Env*) {
 
 Value b_wifi_scan(const std::vector<Value>&, Env*) {
   int n = WiFi.scanNetworks();
-  std::vector<Value> list;
+  ValueList list;
   for (int i = 0; i < n; i++) {
     list.push_back(Value::String(WiFi.SSID(i).c_str()));
   }
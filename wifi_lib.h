@@ -3,6 +3,13 @@
 
 #include "interpreter.h"
 
+// A wifi.connect in progress. While it waits for the link the task sleeps
+// between polls, and the call is retried each time it wakes.
+struct WifiState : LibState {
+  bool connecting = false;
+  int attempts = 0;
+};
+
 void load_wifi_lib(Env* env);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,68 @@
+#include "writer.h"
+#include <new>
+
+// Each `full` count is one block to write, except the one given after the
+// last block, which finds nothing left and stops the task.
+static void writer_task(void* param) {
+  BlockWriter* w = (BlockWriter*)param;
+  uint32_t done = 0;
+  for (;;) {
+    xSemaphoreTake(w->full, portMAX_DELAY);
+    if (done == w->submitted) break;
+    size_t n = w->lens[done & 1];
+    if (!w->failed.load(std::memory_order_relaxed) && w->file.write(w->bufs[done & 1], n) != n)
+      w->failed.store(true, std::memory_order_relaxed);
+    done++;
+    xSemaphoreGive(w->empty);
+  }
+  // Last touch of `w`: finish() may free it as soon as this is seen.
+  xSemaphoreGive(w->stopped);
+  vTaskDelete(NULL);
+}
+
+BlockWriter::~BlockWriter() {
+  finish();
+  if (empty) vSemaphoreDelete(empty);
+  if (full) vSemaphoreDelete(full);
+  if (stopped) vSemaphoreDelete(stopped);
+  delete[] bufs[0];
+  delete[] bufs[1];
+}
+
+bool BlockWriter::begin(File f) {
+  if (!f) return false;
+  file = f;
+  bufs[0] = new (std::nothrow) uint8_t[WRITE_BLOCK];
+  bufs[1] = new (std::nothrow) uint8_t[WRITE_BLOCK];
+  empty = xSemaphoreCreateCounting(2, 2);
+  full = xSemaphoreCreateCounting(3, 0);
+  stopped = xSemaphoreCreateCounting(1, 0);
+  if (!bufs[0] || !bufs[1] || !empty || !full || !stopped) return false;
+  running = xTaskCreatePinnedToCore(writer_task, "WriterTask", WRITER_STACK, this, WRITER_PRIORITY, NULL,
+                                    WRITER_CORE) == pdPASS;
+  return running;
+}
+
+uint8_t* BlockWriter::buffer() {
+  if (!holding) xSemaphoreTake(empty, portMAX_DELAY);
+  holding = true;
+  return failed.load(std::memory_order_relaxed) ? nullptr : bufs[submitted & 1];
+}
+
+void BlockWriter::submit(size_t n) {
+  if (!holding) xSemaphoreTake(empty, portMAX_DELAY);
+  holding = false;
+  lens[submitted & 1] = n;
+  submitted++;
+  xSemaphoreGive(full);
+}
+
+bool BlockWriter::finish() {
+  if (running) {
+    xSemaphoreGive(full);
+    xSemaphoreTake(stopped, portMAX_DELAY);
+    running = false;
+  }
+  if (file) file.close();
+  return !failed.load(std::memory_order_relaxed);
+}
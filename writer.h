@@ -0,0 +1,46 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <Arduino.h>
+#include <SD.h>
+#include <atomic>
+
+// Size of each of a BlockWriter's two buffers, a whole number of SD
+// sectors, and the writer task's stack, priority and core.
+constexpr size_t WRITE_BLOCK = 8192;
+constexpr uint32_t WRITER_STACK = 4096;
+constexpr UBaseType_t WRITER_PRIORITY = 1;
+constexpr BaseType_t WRITER_CORE = 0;
+
+// Writes a file from a task of its own, a block at a time, so the caller
+// can fill one buffer while the other is on its way to the card. Blocks
+// are written in the order they are submitted.
+struct BlockWriter {
+  File file;
+  uint8_t* bufs[2] = { nullptr, nullptr };
+  size_t lens[2] = { 0, 0 };
+  std::atomic<uint32_t> submitted{ 0 };
+  // Buffers the caller may fill; blocks (and, last, the stop request) for
+  // the task to write; and the task's reply that it has stopped.
+  SemaphoreHandle_t empty = nullptr;
+  SemaphoreHandle_t full = nullptr;
+  SemaphoreHandle_t stopped = nullptr;
+  bool running = false;
+  bool holding = false;
+  std::atomic<bool> failed{ false };
+
+  ~BlockWriter();
+
+  // Starts writing to `f`, which is closed by finish(). False if the
+  // buffers or the task could not be had.
+  bool begin(File f);
+  // The buffer to fill next, once the writer has freed one; nullptr after
+  // a write has fallen short.
+  uint8_t* buffer();
+  void submit(size_t n);
+  // Waits for every submitted block to be written, then stops the task and
+  // closes the file. False if any write fell short.
+  bool finish();
+};
+
+#endif